@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# One measured run through the tun, linux only, as root, from the repo root.
+#
+# A SOCKS5 server and an iperf3 server run in a network namespace behind a
+# veth pair. The iperf3 client in the host reaches the server's address only
+# through the ip2socks tun, the SOCKS5 server reaches it on its own loopback.
+#
+# usage: ./scripts/bench_netns.sh BINARY MODE [key=value ...]
+#   MODE       tcp (client uploads) or tcp-reverse (client downloads),
+#              udp and udp-reverse the same with an unpaced udp stream
+#   key=value  overrides a line of scripts/config.linux.example.yml
+# env:
+#   SOCKS_CMD  socks5 server started in the namespace on $SOCKS_IP:1080,
+#              default gost, udp modes need UDP ASSOCIATE
+#   DURATION   seconds of traffic, default 10
+#   UDP_LEN    datagram payload size in udp modes, default 1200
+#
+# Prints the iperf3 summary, the cpu seconds ip2socks used and its counters.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 BINARY MODE [key=value ...]"
+    exit 1
+fi
+
+BIN=$1
+MODE=$2
+shift 2
+
+NS=ip2s-bench
+HOST_IP=10.98.0.1
+SOCKS_IP=10.98.0.2
+TARGET_IP=10.97.0.1
+DURATION=${DURATION:-10}
+UDP_LEN=${UDP_LEN:-1200}
+SOCKS_CMD=${SOCKS_CMD:-"gost -L socks5://$SOCKS_IP:1080"}
+WORK=$(mktemp -d)
+PID=
+
+cleanup() {
+    if [ -n "$PID" ]; then
+        kill -INT $PID 2>/dev/null || true
+        wait $PID 2>/dev/null || true
+    fi
+    for p in $(ip netns pids $NS 2>/dev/null); do
+        kill $p 2>/dev/null || true
+    done
+    ip netns del $NS 2>/dev/null || true
+    ip link del ip2s-veth0 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# the far side, socks server and iperf3 server
+ip netns add $NS
+ip link add ip2s-veth0 type veth peer name ip2s-veth1
+ip link set ip2s-veth1 netns $NS
+ip addr add $HOST_IP/30 dev ip2s-veth0
+ip link set ip2s-veth0 up
+ip netns exec $NS ip addr add $SOCKS_IP/30 dev ip2s-veth1
+ip netns exec $NS ip link set ip2s-veth1 up
+ip netns exec $NS ip link set lo up
+ip netns exec $NS ip addr add $TARGET_IP/32 dev lo
+ip netns exec $NS $SOCKS_CMD > "$WORK/socks.log" 2>&1 &
+ip netns exec $NS iperf3 -s -B $TARGET_IP > "$WORK/iperf3-server.log" 2>&1 &
+
+# only the target goes into the tun, the setup shell gets the tun gateway
+cat > "$WORK/up.sh" <<EOF
+ip route add $TARGET_IP via "\$1"
+EOF
+cat > "$WORK/down.sh" <<EOF
+ip route del $TARGET_IP via "\$1"
+EOF
+
+CONFIG="$WORK/config.yml"
+cp scripts/config.linux.example.yml "$CONFIG"
+set -- socks_server=$SOCKS_IP socks_port=1080 \
+    after_start_shell="'$WORK/up.sh'" before_shutdown_shell="'$WORK/down.sh'" "$@"
+for kv in "$@"; do
+    key=${kv%%=*}
+    value=${kv#*=}
+    if grep -q "^$key:" "$CONFIG"; then
+        sed -i "s|^$key:.*|$key: $value|" "$CONFIG"
+    else
+        echo "$key: $value" >> "$CONFIG"
+    fi
+done
+
+GW=$(awk '/^gw:/ { print $2 }' "$CONFIG")
+
+"$BIN" --config="$CONFIG" > "$WORK/ip2socks.log" 2>&1 &
+PID=$!
+
+i=0
+until ip route get $TARGET_IP 2>/dev/null | grep -q "via $GW"; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+        echo "ip2socks did not come up"
+        cat "$WORK/ip2socks.log"
+        exit 1
+    fi
+    sleep 0.1
+done
+sleep 0.5
+
+case $MODE in
+    tcp) FLAGS= ;;
+    tcp-reverse) FLAGS=-R ;;
+    udp) FLAGS="-u -b 0 -l $UDP_LEN" ;;
+    udp-reverse) FLAGS="-u -b 0 -l $UDP_LEN -R" ;;
+    *)
+        echo "unknown mode $MODE"
+        exit 1
+        ;;
+esac
+
+# cpu of ip2socks and its shards, in clock ticks
+cpu_ticks() {
+    t=0
+    for p in $PID $(ps -o pid= --ppid $PID); do
+        t=$((t + $(awk '{ print $14 + $15 }' /proc/$p/stat)))
+    done
+    echo $t
+}
+
+before=$(cpu_ticks)
+iperf3 -c $TARGET_IP -t $DURATION $FLAGS | grep -E "sender|receiver"
+after=$(cpu_ticks)
+echo "cpu: $(echo "$before $after $(getconf CLK_TCK)" | awk '{ printf "%.2f", ($2 - $1) / $3 }') s"
+
+# the counters are what SIGUSR1 adds to the log
+lines=$(wc -l < "$WORK/ip2socks.log")
+kill -USR1 $PID
+sleep 0.5
+tail -n +$((lines + 1)) "$WORK/ip2socks.log"
@@ -0,0 +1,162 @@
+/*
+ * What tcp_nocopy saves on the upstream -> client path, linux only:
+ *
+ *   cc -O2 -pthread -o bench_tcp_copy scripts/bench_tcp_copy.c
+ *   ./bench_tcp_copy [segment_len] [seconds]
+ *
+ * Upstream bytes are read from a loopback tcp socket into a 256 KB ring like
+ * socks_buf, then cut into segments of segment_len. "copy" allocates each
+ * segment and copies the bytes into it, as tcp_write with TCP_WRITE_FLAG_COPY
+ * does, "ref" only allocates a small descriptor pointing into the ring, as it
+ * does without. "read" is the socket read alone for scale. Prints MB/s and cpu
+ * per 64 KB.
+ */
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define RING_SIZE 0x40000
+
+struct segment {
+    struct segment *next;
+    const char *payload;
+    size_t len;
+};
+
+static volatile int stop;
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+thread_cpu(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the upstream, writes as fast as the reader takes it */
+static void *
+writer(void *arg) {
+    int fd = *(int *) arg;
+    static char buf[0x10000];
+
+    memset(buf, 0x5a, sizeof(buf));
+    while (!stop) {
+        if (write(fd, buf, sizeof(buf)) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void
+connect_pair(int *rfd, int *wfd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(l, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(l, 1) < 0 ||
+        getsockname(l, (struct sockaddr *) &addr, &len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    *wfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*wfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    *rfd = accept(l, NULL, NULL);
+    close(l);
+}
+
+static void
+run(const char *mode, size_t seg_len, double seconds) {
+    static char ring[RING_SIZE];
+    unsigned long long bytes = 0;
+    int rfd, wfd;
+    pthread_t t;
+
+    connect_pair(&rfd, &wfd);
+    stop = 0;
+    pthread_create(&t, NULL, writer, &wfd);
+
+    double start = now(), cpu_start = thread_cpu(), elapsed;
+    size_t head = 0;
+    do {
+        size_t room = RING_SIZE - head;
+        ssize_t n = read(rfd, ring + head, room > 0x10000 ? 0x10000 : room);
+        size_t off;
+
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        for (off = 0; strcmp(mode, "read") != 0 && off < (size_t) n; off += seg_len) {
+            size_t len = (size_t) n - off < seg_len ? (size_t) n - off : seg_len;
+            struct segment *seg;
+
+            if (strcmp(mode, "copy") == 0) {
+                seg = (struct segment *) malloc(sizeof(struct segment) + len);
+                memcpy(seg + 1, ring + head + off, len);
+                seg->payload = (const char *) (seg + 1);
+            } else {
+                seg = (struct segment *) malloc(sizeof(struct segment));
+                seg->payload = ring + head + off;
+            }
+            seg->len = len;
+            /* acked right away, the client side is not what is measured */
+            __asm__ __volatile__("" : : "r"(seg->payload) : "memory");
+            free(seg);
+        }
+        bytes += (unsigned long long) n;
+        head = (head + (size_t) n) % RING_SIZE;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    double used = thread_cpu() - cpu_start;
+    stop = 1;
+    shutdown(rfd, SHUT_RDWR);
+    pthread_join(t, NULL);
+    close(rfd);
+    close(wfd);
+
+    printf("%-4s segment %5zu: %7.0f MB/s, %6.0f ns cpu per 64 KB\n", mode, seg_len, bytes / elapsed / 1e6,
+           used * 1e9 / (bytes / 65536.));
+}
+
+int
+main(int argc, char **argv) {
+    size_t seg_len = argc > 1 ? (size_t) atol(argv[1]) : 1460;
+    double seconds = argc > 2 ? atof(argv[2]) : 3;
+    int i;
+
+    if (seg_len == 0 || seg_len > 0xffff) {
+        fprintf(stderr, "usage: %s [segment_len 1..65535] [seconds]\n", argv[0]);
+        return 1;
+    }
+    for (i = 0; i < 2; i++) {
+        run("read", seg_len, seconds);
+        run("copy", seg_len, seconds);
+        run("ref", seg_len, seconds);
+    }
+    return 0;
+}
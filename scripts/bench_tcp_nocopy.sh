@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# tcp download through the tun with tcp_nocopy off and on, one build:
+#
+#   ./scripts/bench_tcp_nocopy.sh ./ip2socks
+#
+# Same setup and env as scripts/bench_netns.sh, extra key=value pass on to it.
+# Compare the throughput and the cpu seconds, nocopy saves the copy into segments.
+# scripts/bench_tcp_copy.c times that copy alone against the upstream read.
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 BINARY [key=value ...]"
+    exit 1
+fi
+
+BIN=$1
+shift
+
+for nocopy in false true; do
+    echo "== tcp_nocopy: $nocopy"
+    sh ./scripts/bench_netns.sh "$BIN" tcp-reverse tcp_nocopy=$nocopy "$@" | grep -E "sender|receiver|cpu"
+done
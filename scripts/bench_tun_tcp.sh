@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# tcp download through the tun with two ip2socks builds, e.g. the commits
+# before and after a change to the tun write path:
+#
+#   ./scripts/bench_tun_tcp.sh ./build-before/ip2socks ./build-after/ip2socks
+#
+# Same setup and env as scripts/bench_netns.sh, extra key=value pass on to it.
+# Compare the throughput, the cpu seconds and tun tx syscalls per packet.
+# scripts/bench_tun_write.c times the tun writes alone, copy against writev.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 BINARY_BEFORE BINARY_AFTER [key=value ...]"
+    exit 1
+fi
+
+BEFORE=$1
+AFTER=$2
+shift 2
+
+for bin in "$BEFORE" "$AFTER"; do
+    echo "== $bin"
+    sh ./scripts/bench_netns.sh "$bin" tcp-reverse "$@" | grep -E "sender|receiver|cpu|tun tx"
+done
@@ -0,0 +1,238 @@
+/*
+ * Kernel side of udp_offload, linux only, run by scripts/bench_udp_gso.sh:
+ *
+ *   bench_udp_gso recv PORT
+ *   bench_udp_gso send ADDR PORT MODE PAYLOAD_LEN HDR_LEN SECONDS
+ *
+ * The sender queues datagrams of a HDR_LEN byte socks udp header and
+ * PAYLOAD_LEN bytes, gathered from two iovecs each, and flushes every
+ * UDP_RELAY_BATCH of them. MODE "mmsg" sends them with one sendmmsg, "gso"
+ * merges the run into one UDP_SEGMENT send the way udp_raw_flush does: EIO
+ * turns segmentation off, EINVAL or EMSGSIZE stop merging that size, and both
+ * resend the run unmerged. The receiver sets UDP_GRO and splits coalesced
+ * reads. Both print their counters in the form of the stats lines.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define UDP_RELAY_BATCH 16
+#define END_LEN 1
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int
+bench_recv(int port) {
+    static char buf[UDP_RELAY_BATCH][0x10000];
+    static char ctrl[UDP_RELAY_BATCH][CMSG_SPACE(sizeof(int))];
+    struct mmsghdr msgs[UDP_RELAY_BATCH];
+    struct iovec iov[UDP_RELAY_BATCH];
+    struct sockaddr_in addr;
+    unsigned long datagrams = 0, syscalls = 0, gro_reads = 0;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int opt = 1, rcvbuf = 8 * 1024 * 1024, i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short) port);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        setsockopt(fd, IPPROTO_UDP, UDP_GRO, &opt, sizeof(opt)) < 0) {
+        perror("recv socket");
+        return 1;
+    }
+    for (;;) {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < UDP_RELAY_BATCH; i++) {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = sizeof(buf[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = ctrl[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+        int n = recvmmsg(fd, msgs, UDP_RELAY_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            perror("recvmmsg");
+            return 1;
+        }
+        syscalls++;
+        for (i = 0; i < n; i++) {
+            unsigned int len = msgs[i].msg_len;
+            int seg = 0;
+            struct cmsghdr *cmsg;
+
+            if (len == END_LEN) {
+                printf("udp relay: rx %lu datagrams in %lu syscalls\nudp offload: gro reads %lu\n", datagrams,
+                       syscalls - 1, gro_reads);
+                fflush(stdout);
+                datagrams = syscalls = gro_reads = 0;
+                continue;
+            }
+            for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+                }
+            }
+            if (seg > 0 && len > (unsigned int) seg) {
+                gro_reads++;
+                datagrams += (len + seg - 1) / seg;
+            } else {
+                datagrams++;
+            }
+        }
+    }
+}
+
+struct sender {
+    int fd;
+    struct sockaddr_in addr;
+    struct iovec iov[UDP_RELAY_BATCH * 2];
+    size_t seg;
+    int gso;
+    size_t gso_max_seg;
+    unsigned long datagrams, syscalls, gso_sends, fallbacks, drops;
+};
+
+/* one flush of a full queue, the datagrams are all alike */
+static void
+flush(struct sender *s) {
+    int i = 0;
+
+    while (i < UDP_RELAY_BATCH) {
+        int segs = s->gso && s->seg <= s->gso_max_seg ? UDP_RELAY_BATCH - i : 1;
+        char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+        struct mmsghdr msgs[UDP_RELAY_BATCH];
+        int m, count = 0;
+
+        memset(msgs, 0, sizeof(msgs));
+        for (m = i; m < UDP_RELAY_BATCH; m += segs, count++) {
+            struct msghdr *msg = &msgs[count].msg_hdr;
+            msg->msg_name = &s->addr;
+            msg->msg_namelen = sizeof(s->addr);
+            msg->msg_iov = &s->iov[m * 2];
+            msg->msg_iovlen = (size_t) segs * 2;
+            if (segs > 1) {
+                struct cmsghdr *cmsg;
+                uint16_t gso_size = (uint16_t) s->seg;
+
+                msg->msg_control = ctrl;
+                msg->msg_controllen = sizeof(ctrl);
+                cmsg = CMSG_FIRSTHDR(msg);
+                cmsg->cmsg_level = IPPROTO_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+                memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+        }
+        int sent = sendmmsg(s->fd, msgs, (unsigned int) count, 0);
+        s->syscalls++;
+        if (sent <= 0 && segs > 1 && (errno == EIO || errno == EINVAL || errno == EMSGSIZE)) {
+            if (errno == EIO) {
+                s->gso = 0;
+            } else {
+                s->gso_max_seg = s->seg - 1;
+            }
+            if (s->fallbacks++ == 0) {
+                printf("udp segment of %zu bytes refused: %s, resend unmerged\n", s->seg, strerror(errno));
+            }
+            continue;
+        }
+        if (sent <= 0) {
+            /* socket buffer full, like the relay the queue is dropped */
+            s->drops += UDP_RELAY_BATCH - i;
+            return;
+        }
+        s->datagrams += (unsigned long) sent * segs;
+        if (segs > 1) {
+            s->gso_sends += sent;
+        }
+        i += sent * segs;
+    }
+}
+
+static int
+bench_send(const char *addr, int port, const char *mode, size_t payload_len, size_t hdr_len, double seconds) {
+    static char hdr[512], payload[0x10000];
+    struct sender s;
+    int i;
+
+    memset(&s, 0, sizeof(s));
+    s.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    s.addr.sin_family = AF_INET;
+    s.addr.sin_port = htons((unsigned short) port);
+    s.addr.sin_addr.s_addr = inet_addr(addr);
+    s.seg = hdr_len + payload_len;
+    s.gso = strcmp(mode, "gso") == 0;
+    s.gso_max_seg = 0xffff;
+    for (i = 0; i < UDP_RELAY_BATCH; i++) {
+        s.iov[i * 2].iov_base = hdr;
+        s.iov[i * 2].iov_len = hdr_len;
+        s.iov[i * 2 + 1].iov_base = payload;
+        s.iov[i * 2 + 1].iov_len = payload_len;
+    }
+
+    double start = now(), cpu_start = cpu(), elapsed;
+    do {
+        flush(&s);
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    double used = cpu() - cpu_start;
+
+    printf("%-4s datagram %4zu: %8.0f datagrams/s sent, %5.0f ns sender cpu per datagram, %lu dropped\n", mode, s.seg,
+           s.datagrams / elapsed, used * 1e9 / s.datagrams, s.drops);
+    printf("udp relay: tx %lu datagrams in %lu syscalls\nudp offload: gso sends %lu\n", s.datagrams, s.syscalls,
+           s.gso_sends);
+    fflush(stdout);
+    usleep(300000);
+    sendto(s.fd, "e", END_LEN, 0, (struct sockaddr *) &s.addr, sizeof(s.addr));
+    usleep(100000);
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "recv") == 0) {
+        return bench_recv(atoi(argv[2]));
+    }
+    if (argc == 8 && strcmp(argv[1], "send") == 0) {
+        return bench_send(argv[2], atoi(argv[3]), argv[4], (size_t) atol(argv[5]), (size_t) atol(argv[6]),
+                          atof(argv[7]));
+    }
+    fprintf(stderr, "usage: %s recv PORT\n       %s send ADDR PORT mmsg|gso PAYLOAD_LEN HDR_LEN SECONDS\n", argv[0],
+            argv[0]);
+    return 1;
+}
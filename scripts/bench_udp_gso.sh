@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# udp relay sends with and without UDP_SEGMENT over a veth of ethernet mtu
+# into a network namespace, linux only, as root, from the repo root:
+#
+#   ./scripts/bench_udp_gso.sh
+#
+# Builds scripts/bench_udp_gso.c. Cases are PAYLOAD_LEN:HDR_LEN, a 10 byte
+# socks header is an ipv4 ATYP, 27 a domain of 20 characters. 1452 bytes
+# behind a domain header no longer fit the 1472 bytes of a 1500 mtu.
+# env:
+#   DURATION   seconds per run, default 3
+#   CASES      default "1200:10 1452:10 1452:27"
+
+set -e
+
+NS=ip2s-gso
+HOST_IP=10.99.0.1
+PEER_IP=10.99.0.2
+PORT=9000
+DURATION=${DURATION:-3}
+CASES=${CASES:-"1200:10 1452:10 1452:27"}
+WORK=$(mktemp -d)
+
+cleanup() {
+    for p in $(ip netns pids $NS 2>/dev/null); do
+        kill $p 2>/dev/null || true
+    done
+    ip netns del $NS 2>/dev/null || true
+    ip link del ip2s-gso0 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+cc -O2 -o "$WORK/bench_udp_gso" scripts/bench_udp_gso.c
+
+ip netns add $NS
+ip link add ip2s-gso0 mtu 1500 type veth peer name ip2s-gso1 mtu 1500
+ip link set ip2s-gso1 netns $NS
+ip addr add $HOST_IP/30 dev ip2s-gso0
+ip link set ip2s-gso0 up
+ip netns exec $NS ip addr add $PEER_IP/30 dev ip2s-gso1
+ip netns exec $NS ip link set ip2s-gso1 up
+ip netns exec $NS "$WORK/bench_udp_gso" recv $PORT > "$WORK/recv.log" 2>&1 &
+sleep 0.5
+
+for c in $CASES; do
+    for mode in mmsg gso; do
+        echo "== $mode payload ${c%%:*} header ${c#*:}"
+        lines=$(wc -l < "$WORK/recv.log")
+        "$WORK/bench_udp_gso" send $PEER_IP $PORT $mode ${c%%:*} ${c#*:} $DURATION
+        tail -n +$((lines + 1)) "$WORK/recv.log"
+    done
+done
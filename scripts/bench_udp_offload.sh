@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# unpaced udp stream through the tun and the socks udp relay with udp_offload
+# off and on, one build:
+#
+#   ./scripts/bench_udp_offload.sh ./ip2socks
+#
+# Same setup and env as scripts/bench_netns.sh, extra key=value pass on to it.
+# Compare the datagrams that arrived, the cpu seconds and the relay syscalls,
+# gso sends and gro reads. MODE=udp-reverse measures the receive side.
+# scripts/bench_udp_gso.sh runs the relay socket side alone over an ethernet mtu veth.
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 BINARY [key=value ...]"
+    exit 1
+fi
+
+BIN=$1
+shift
+
+for offload in false true; do
+    echo "== udp_offload: $offload"
+    sh ./scripts/bench_netns.sh "$BIN" "${MODE:-udp}" udp_offload=$offload "$@" |
+        grep -E "sender|receiver|cpu|udp relay|udp offload"
+done
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# unpaced udp stream through the tun and the socks udp relay with two ip2socks
+# builds, e.g. the commits before and after a change to the relay socket io:
+#
+#   ./scripts/bench_udp_relay.sh ./build-before/ip2socks ./build-after/ip2socks
+#
+# Same setup and env as scripts/bench_netns.sh, extra key=value pass on to it.
+# Compare the datagrams that arrived, the cpu seconds and the relay syscalls
+# per datagram. MODE=udp-reverse measures the receive side.
+# scripts/bench_udp_mmsg.c times the relay socket calls alone, single against batched.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 BINARY_BEFORE BINARY_AFTER [key=value ...]"
+    exit 1
+fi
+
+BEFORE=$1
+AFTER=$2
+shift 2
+
+for bin in "$BEFORE" "$AFTER"; do
+    echo "== $bin"
+    sh ./scripts/bench_netns.sh "$bin" "${MODE:-udp}" "$@" | grep -E "sender|receiver|cpu|udp relay"
+done
@@ -44,3 +44,73 @@ char *get_query_domain(const u_char *payload, int paylen, FILE *trace) {
 
     return hostname_from_question(msg);
 }
+
+/**
+ * qtype of the first question, -1 if there is none
+ */
+int get_query_type(const u_char *payload, int paylen) {
+    ns_msg msg;
+    ns_rr rr;
+
+    if (ns_initparse(payload, paylen, &msg) < 0 || ns_msg_count(msg, ns_s_qd) == 0) {
+        return -1;
+    }
+    if (ns_parserr(&msg, ns_s_qd, 0, &rr)) {
+        return -1;
+    }
+    return ns_rr_type(rr);
+}
+
+/**
+ * reply to query with one A record for addr (network order), no answer at all if addr is 0.
+ * only the first question is kept, additional records (edns) are dropped.
+ * return the reply length, -1 if the query is malformed or out is too small
+ */
+int build_a_answer(const u_char *query, int qlen, u_char *out, int outlen, uint32_t addr, uint32_t ttl) {
+    int off = NS_HFIXEDSZ;
+
+    if (qlen < NS_HFIXEDSZ) {
+        return -1;
+    }
+    // skip the question name, labels only, queries are not compressed
+    while (off < qlen && query[off] != 0) {
+        if ((query[off] & NS_CMPRSFLGS) != 0) {
+            return -1;
+        }
+        off += query[off] + 1;
+    }
+    off += 1 + NS_QFIXEDSZ;
+    if (off > qlen || off + NS_RRFIXEDSZ + 2 + NS_INADDRSZ > outlen) {
+        return -1;
+    }
+
+    memcpy(out, query, off);
+    out[2] = (u_char) ((query[2] & 0x79) | 0x80); // QR, keep opcode and RD, clear AA and TC
+    out[3] = 0x80; // RA, NOERROR
+    out[4] = 0;
+    out[5] = 1; // QDCOUNT
+    out[6] = 0;
+    out[7] = addr != 0 ? 1 : 0; // ANCOUNT
+    memset(out + 8, 0, 4); // NSCOUNT, ARCOUNT
+
+    if (addr == 0) {
+        return off;
+    }
+
+    out[off++] = NS_CMPRSFLGS; // name: pointer to the question
+    out[off++] = NS_HFIXEDSZ;
+    out[off++] = 0;
+    out[off++] = ns_t_a;
+    out[off++] = 0;
+    out[off++] = ns_c_in;
+    out[off++] = (u_char) (ttl >> 24);
+    out[off++] = (u_char) (ttl >> 16);
+    out[off++] = (u_char) (ttl >> 8);
+    out[off++] = (u_char) ttl;
+    out[off++] = 0;
+    out[off++] = NS_INADDRSZ;
+    memcpy(out + off, &addr, NS_INADDRSZ);
+    off += NS_INADDRSZ;
+
+    return off;
+}
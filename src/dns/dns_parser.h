@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -7,6 +8,10 @@ extern "C" {
 
 char *get_query_domain(const u_char *payload, int paylen, FILE *trace);
 
+int get_query_type(const u_char *payload, int paylen);
+
+int build_a_answer(const u_char *query, int qlen, u_char *out, int outlen, uint32_t addr, uint32_t ttl);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,164 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "ev.h"
+
+#include "fake_ip.h"
+#include "stats.h"
+
+#define FAKE_IP_NONE 0xffffffff
+
+typedef struct fake_ip_entry {
+    std::string domain;
+    ev_tstamp used;
+    uint32_t prev; // lru list, head is the most recently used
+    uint32_t next;
+} fake_ip_entry;
+
+static uint32_t fake_base = 0; // first usable address, host order
+static uint32_t fake_size = 0; // usable addresses, 0 if off
+static uint32_t fake_ttl_s = FAKE_IP_TTL;
+
+// index is address - fake_base, grows until the range is used up, then the lru tail is recycled
+static std::vector<fake_ip_entry> fake_entries;
+static std::unordered_map<std::string, uint32_t> fake_by_domain;
+static uint32_t lru_head = FAKE_IP_NONE;
+static uint32_t lru_tail = FAKE_IP_NONE;
+
+static void lru_unlink(uint32_t i) {
+    fake_ip_entry &e = fake_entries[i];
+
+    if (e.prev != FAKE_IP_NONE) {
+        fake_entries[e.prev].next = e.next;
+    } else {
+        lru_head = e.next;
+    }
+    if (e.next != FAKE_IP_NONE) {
+        fake_entries[e.next].prev = e.prev;
+    } else {
+        lru_tail = e.prev;
+    }
+}
+
+static void lru_push(uint32_t i) {
+    fake_ip_entry &e = fake_entries[i];
+
+    e.prev = FAKE_IP_NONE;
+    e.next = lru_head;
+    if (lru_head != FAKE_IP_NONE) {
+        fake_entries[lru_head].prev = i;
+    } else {
+        lru_tail = i;
+    }
+    lru_head = i;
+    e.used = ev_now(EV_DEFAULT);
+}
+
+static void lru_touch(uint32_t i) {
+    if (lru_head != i) {
+        lru_unlink(i);
+        lru_push(i);
+    } else {
+        fake_entries[i].used = ev_now(EV_DEFAULT);
+    }
+}
+
+/**
+ * cidr like 198.18.0.0/15, network and broadcast addresses are not handed out
+ */
+int fake_ip_init(const char *cidr, int ttl) {
+    char net[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    const char *slash = strchr(cidr, '/');
+
+    if (slash == NULL || slash - cidr >= INET_ADDRSTRLEN) {
+        printf("fake_ip_range %s is not a cidr\n", cidr);
+        return -1;
+    }
+    memcpy(net, cidr, slash - cidr);
+    net[slash - cidr] = '\0';
+
+    int prefix = atoi(slash + 1);
+    if (inet_aton(net, &addr) == 0 || prefix < 8 || prefix > 30) {
+        printf("fake_ip_range %s needs an ipv4 network with a /8 to /30 prefix\n", cidr);
+        return -1;
+    }
+
+    uint32_t mask = 0xffffffffu << (32 - prefix);
+    fake_base = (ntohl(addr.s_addr) & mask) + 1;
+    fake_size = (~mask) - 1;
+    if (ttl > 0) {
+        fake_ttl_s = (uint32_t) ttl;
+    }
+
+    fake_entries.clear();
+    fake_by_domain.clear();
+    lru_head = lru_tail = FAKE_IP_NONE;
+    return 0;
+}
+
+bool fake_ip_enabled() {
+    return fake_size > 0;
+}
+
+uint32_t fake_ip_ttl() {
+    return fake_ttl_s;
+}
+
+/**
+ * address for domain in network order, a new one or the least recently used one recycled
+ */
+uint32_t fake_ip_lookup(const std::string &domain) {
+    std::unordered_map<std::string, uint32_t>::iterator it = fake_by_domain.find(domain);
+    uint32_t i;
+
+    if (it != fake_by_domain.end()) {
+        i = it->second;
+        lru_touch(i);
+        return htonl(fake_base + i);
+    }
+
+    if (fake_entries.size() < fake_size) {
+        i = (uint32_t) fake_entries.size();
+        fake_entries.push_back(fake_ip_entry());
+    } else {
+        i = lru_tail;
+        lru_unlink(i);
+        if (ev_now(EV_DEFAULT) - fake_entries[i].used < fake_ttl_s) {
+            // clients may still hold the old answer, their flows go to the new domain
+            stats.fake_ip_recycled_live++;
+        }
+        stats.fake_ip_recycled++;
+        fake_by_domain.erase(fake_entries[i].domain);
+    }
+
+    fake_entries[i].domain = domain;
+    fake_by_domain[domain] = i;
+    lru_push(i);
+    return htonl(fake_base + i);
+}
+
+bool fake_ip_contains(uint32_t addr) {
+    return fake_size > 0 && ntohl(addr) - fake_base < fake_size;
+}
+
+/**
+ * domain behind a fake address in network order, NULL if it is not one or unknown
+ */
+const char *fake_ip_domain(uint32_t addr) {
+    if (!fake_ip_contains(addr)) {
+        return NULL;
+    }
+
+    uint32_t i = ntohl(addr) - fake_base;
+    if (i >= fake_entries.size()) {
+        return NULL;
+    }
+    lru_touch(i);
+    return fake_entries[i].domain.c_str();
+}
@@ -0,0 +1,26 @@
+#ifndef IP2SOCKS_FAKE_IP_H
+#define IP2SOCKS_FAKE_IP_H
+
+#include <stdint.h>
+#include <string>
+
+/* ttl of fake answers, clients come back often enough to keep their domains recent */
+#define FAKE_IP_TTL 60
+
+/**
+ * domain <-> address map over a reserved range, A queries are answered from it
+ * and flows to an address in it are sent to the proxy by domain name
+ */
+int fake_ip_init(const char *cidr, int ttl);
+
+bool fake_ip_enabled();
+
+uint32_t fake_ip_ttl();
+
+uint32_t fake_ip_lookup(const std::string &domain);
+
+bool fake_ip_contains(uint32_t addr);
+
+const char *fake_ip_domain(uint32_t addr);
+
+#endif //IP2SOCKS_FAKE_IP_H
@@ -445,6 +445,17 @@
 #define LWIP_HOOK_IP6_NETIF(ip6hdr) netif_list
 #define LWIP_HOOK_TCP_LISTEN_PCB(tcphdr) tcp_listen_pcbs.listen_pcbs
 #define LWIP_HOOK_UDP_LISTEN_PCB 1
+
+/* tcp_connect_first: new SYNs wait in tcp_raw.cpp until the socks CONNECT is answered */
+#define LWIP_HOOK_IP4_INPUT(pbuf, input_netif) tcp_raw_ip4_input_hook(pbuf, input_netif)
+#if !defined(__ASSEMBLER__)
+struct pbuf;
+struct netif;
+#ifdef __cplusplus
+extern "C"
+#endif
+int tcp_raw_ip4_input_hook(struct pbuf *p, struct netif *inp);
+#endif
 /* hook config end */
 
 
@@ -471,10 +482,27 @@
 #define SO_REUSE 1
 #define SO_REUSE_RXTOALL 1
 
-#define TCP_MSS 1460
-#define TCP_WND 0xFFFF
-#define TCP_SND_BUF 65535
+/*
+ * TCP_MSS only caps the mss, the advertised and the effective one follow the netif
+ * mtu (TCP_CALCULATE_EFF_SEND_MSS), so a jumbo tun mtu up to 64K gets matching
+ * segments. A few of those need a scaled window.
+ */
+#define TCP_MSS (0xFFFF - 40)
+#define LWIP_WND_SCALE 1
+#define TCP_RCV_SCALE 2
+#define TCP_WND (4 * 0xFFFF)
+#define TCP_SND_BUF (4 * 0xFFFF)
 #define TCP_SND_QUEUELEN (1024 * (TCP_SND_BUF)/(TCP_MSS))
+/*
+ * tcp_write allocates up to TCP_OVERSIZE bytes ahead, TCP_MSS by default. With a tso
+ * mss every small write would take a near 64K pbuf, larger segments chain instead.
+ */
+#define TCP_OVERSIZE 1460
+/* tcp_raw keeps the peer's mss of a tun offload flow and a closed flow's socks_buf until lwip frees the pcb */
+#define LWIP_TCP_PCB_NUM_EXT_ARGS 2
+
+/* pool pbufs (tapif) stay ethernet sized and chain, do not follow TCP_MSS */
+#define PBUF_POOL_BUFSIZE LWIP_MEM_ALIGN_SIZE(1460 + 40 + PBUF_LINK_ENCAPSULATION_HLEN + PBUF_LINK_HLEN)
 
 #define LWIP_NOASSERT 0
 
@@ -483,6 +511,12 @@
 
 #define PPP_SUPPORT 0
 
+/* tunif receives into its own buffers handed to lwip as custom pbufs */
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
+/* tunif with offload leaves tcp/udp checksums to the kernel */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
 /* to fix https://github.com/FlowerWrong/ip2socks/issues/4 */
 #define LWIP_DONT_PROVIDE_BYTEORDER_FUNCTIONS 0
 
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 
@@ -15,11 +17,14 @@
 #include "lwip/ip4_frag.h"
 
 #include "struct.h"
+#include "stats.h"
 #include "util.h"
 #include "var.h"
 
 #if defined(LWIP_UNIX_LINUX)
 
+#include <sys/prctl.h>
+
 #include "netif/tapif.h"
 #include "netif/etharp.h"
 
@@ -29,12 +34,35 @@
 
 #include "udp_raw.h"
 #include "tcp_raw.h"
+#include "socks5_pool.h"
+#include "fake_ip.h"
+
+#ifndef SYS_TIMEOUTS_SLEEPTIME_INFINITE
+#define SYS_TIMEOUTS_SLEEPTIME_INFINITE 0xFFFFFFFF
+#endif
 
 /* lwip host IP configuration */
 struct netif netif;
 static ip4_addr_t ipaddr, netmask, gw;
 static char *config_file;
 
+/* lwip timeouts, re-armed before every poll */
+static ev_timer lwip_timer;
+static ev_prepare lwip_prepare;
+static u32_t lwip_timer_due;
+
+/* tun/tap packets and bytes read per readiness event */
+static int tuntap_read_budget = 64;
+static int tuntap_read_budget_bytes = 256 * 1024;
+
+/**
+ * sharded mode, one worker process per tun queue: lwip (NO_SYS) keeps its state in
+ * globals, so every queue gets its own lwip instance in its own process
+ */
+static struct tunif_conf tunif_conf;
+static int shard_id = 0; // 0 is the parent
+static std::vector<pid_t> shard_pids;
+
 /* nonstatic debug cmd option, exported in lwipopts.h */
 unsigned char debug_flags;
 
@@ -60,8 +88,18 @@ void sigterm_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
 
 void sigint_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
 
+void sigusr1_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
+
 void sigusr2_cb(struct ev_loop *loop, ev_signal *watcher, int revents);
 
+void lwip_timer_cb(struct ev_loop *loop, ev_timer *watcher, int revents);
+
+void lwip_prepare_cb(struct ev_loop *loop, ev_prepare *watcher, int revents);
+
+void fork_shards(int queues);
+
+void stop_shards();
+
 static void
 usage(void) {
     unsigned char i;
@@ -190,6 +228,44 @@ void parse_config(int argc, char **argv) {
                         datap = &conf->after_start_shell;
                     } else if (strcmp(tk, "before_shutdown_shell") == 0) {
                         datap = &conf->before_shutdown_shell;
+                    } else if (strcmp(tk, "tuntap_read_budget") == 0) {
+                        datap = &conf->tuntap_read_budget;
+                    } else if (strcmp(tk, "tuntap_read_budget_bytes") == 0) {
+                        datap = &conf->tuntap_read_budget_bytes;
+                    } else if (strcmp(tk, "tun_queues") == 0) {
+                        datap = &conf->tun_queues;
+                    } else if (strcmp(tk, "tun_offload") == 0) {
+                        datap = &conf->tun_offload;
+                    } else if (strcmp(tk, "io_backend") == 0) {
+                        datap = &conf->io_backend;
+                    } else if (strcmp(tk, "mtu") == 0) {
+                        datap = &conf->mtu;
+                    } else if (strcmp(tk, "tun_tx_batch_bytes") == 0) {
+                        datap = &conf->tun_tx_batch_bytes;
+                    } else if (strcmp(tk, "tcp_nocopy") == 0) {
+                        datap = &conf->tcp_nocopy;
+                    } else if (strcmp(tk, "socks_pool_size") == 0) {
+                        datap = &conf->socks_pool_size;
+                    } else if (strcmp(tk, "socks_pool_max_idle") == 0) {
+                        datap = &conf->socks_pool_max_idle;
+                    } else if (strcmp(tk, "socks_pipeline") == 0) {
+                        datap = &conf->socks_pipeline;
+                    } else if (strcmp(tk, "socks_fastopen") == 0) {
+                        datap = &conf->socks_fastopen;
+                    } else if (strcmp(tk, "fake_ip_range") == 0) {
+                        datap = &conf->fake_ip_range;
+                    } else if (strcmp(tk, "fake_ip_ttl") == 0) {
+                        datap = &conf->fake_ip_ttl;
+                    } else if (strcmp(tk, "tcp_connect_first") == 0) {
+                        datap = &conf->tcp_connect_first;
+                    } else if (strcmp(tk, "udp_nat_max") == 0) {
+                        datap = &conf->udp_nat_max;
+                    } else if (strcmp(tk, "udp_nat_timeout") == 0) {
+                        datap = &conf->udp_nat_timeout;
+                    } else if (strcmp(tk, "udp_associations") == 0) {
+                        datap = &conf->udp_associations;
+                    } else if (strcmp(tk, "udp_offload") == 0) {
+                        datap = &conf->udp_offload;
                     } else {
                         printf("Unrecognised key: %s\n", tk);
                     }
@@ -240,6 +316,57 @@ void parse_config(int argc, char **argv) {
     if (conf->dns_mode == NULL) {
         memcpy(conf->dns_mode, "tcp", 3);
     }
+    if (conf->tuntap_read_budget != NULL && atoi(conf->tuntap_read_budget) > 0) {
+        tuntap_read_budget = atoi(conf->tuntap_read_budget);
+    }
+    if (conf->tuntap_read_budget_bytes != NULL && atoi(conf->tuntap_read_budget_bytes) > 0) {
+        tuntap_read_budget_bytes = atoi(conf->tuntap_read_budget_bytes);
+    }
+
+    tunif_conf.queues = 1;
+    if (conf->tun_queues != NULL && atoi(conf->tun_queues) > 1) {
+#if defined(LWIP_UNIX_LINUX)
+        tunif_conf.queues = atoi(conf->tun_queues);
+#else
+        printf("tun_queues is only supported on linux, use 1 queue\n");
+#endif
+    }
+    if (tunif_conf.queues > 1 && conf->fake_ip_range != NULL && strlen(conf->fake_ip_range) > 0) {
+        /* every shard would keep its own map, flows land on shards that never answered their query */
+        printf("fake_ip_range needs tun_queues: 1, each queue's worker has its own fake ip map\n");
+        exit(1);
+    }
+    if (conf->tun_offload != NULL && strcmp("true", conf->tun_offload) == 0) {
+#if defined(LWIP_UNIX_LINUX)
+        tunif_conf.offload = 1;
+        tunif_conf.tcp_mss = tcp_raw_peer_mss;
+#else
+        printf("tun_offload is only supported on linux\n");
+#endif
+    }
+    if (conf->io_backend != NULL && strcmp("uring", conf->io_backend) == 0) {
+#if defined(HAVE_LINUX_IO_URING_H)
+        tunif_conf.uring = 1;
+#else
+        printf("io_backend uring is not supported by this build, use epoll\n");
+#endif
+    }
+    /* batched tun writes go through io_uring, only with io_backend: uring */
+    if (tunif_conf.uring) {
+        tunif_conf.tx_batch_bytes = 256 * 1024;
+        if (conf->tun_tx_batch_bytes != NULL) {
+            tunif_conf.tx_batch_bytes = atoi(conf->tun_tx_batch_bytes);
+        }
+    } else if (conf->tun_tx_batch_bytes != NULL && atoi(conf->tun_tx_batch_bytes) > 0) {
+        printf("tun_tx_batch_bytes needs io_backend: uring, tun writes are not batched\n");
+    }
+    if (conf->mtu != NULL && atoi(conf->mtu) > 0) {
+        if (strcmp(conf->ip_mode, "tun") == 0) {
+            tunif_conf.mtu = atoi(conf->mtu);
+        } else {
+            printf("mtu is only supported in tun mode, tap uses 1500\n");
+        }
+    }
 
     strncpy(ip_str, ip4addr_ntoa(&ipaddr), sizeof(ip_str));
     strncpy(nm_str, ip4addr_ntoa(&netmask), sizeof(nm_str));
@@ -285,7 +412,7 @@ main(int argc, char **argv) {
     lwip_init();
 
     if (strcmp(conf->ip_mode, "tun") == 0) {
-        netif_add(&netif, &ipaddr, &netmask, &gw, NULL, tunif_init, ip_input); // IPV4 IPV6 TODO
+        netif_add(&netif, &ipaddr, &netmask, &gw, &tunif_conf, tunif_init, ip_input); // IPV4 IPV6 TODO
     } else {
 #if defined(LWIP_UNIX_LINUX)
         netif_add(&netif, &ipaddr, &netmask, &gw, NULL, tapif_init, ethernet_input);
@@ -299,6 +426,39 @@ main(int argc, char **argv) {
     netif_create_ip6_linklocal_address(&netif, 1);
 #endif
 
+    if (strcmp(conf->ip_mode, "tun") == 0 && tunif_conf.offload) {
+        tcp_raw_set_tso_mss(TUNIF_TSO_MSS);
+    }
+    if (conf->tcp_nocopy != NULL && strcmp(conf->tcp_nocopy, "true") == 0) {
+        tcp_raw_set_nocopy(1);
+    }
+    if (conf->socks_pipeline != NULL && strcmp(conf->socks_pipeline, "true") == 0) {
+        socks5_set_pipeline(1);
+    }
+    if (conf->socks_fastopen != NULL && strcmp(conf->socks_fastopen, "true") == 0) {
+        socks5_set_fastopen(1);
+    }
+    if (conf->tcp_connect_first != NULL && strcmp(conf->tcp_connect_first, "true") == 0) {
+        tcp_raw_set_connect_first(1);
+    }
+    if (conf->fake_ip_range != NULL && strlen(conf->fake_ip_range) > 0) {
+        fake_ip_init(conf->fake_ip_range, conf->fake_ip_ttl != NULL ? atoi(conf->fake_ip_ttl) : 0);
+    }
+    udp_raw_set_nat(conf->udp_nat_max != NULL ? atoi(conf->udp_nat_max) : 0,
+                    conf->udp_nat_timeout != NULL ? atoi(conf->udp_nat_timeout) : 0);
+    if (conf->udp_associations != NULL) {
+        udp_raw_set_associations(atoi(conf->udp_associations));
+    }
+    if (conf->udp_offload != NULL && strcmp(conf->udp_offload, "true") == 0) {
+        udp_raw_set_offload(1);
+    }
+
+#if defined(LWIP_UNIX_LINUX)
+    if (strcmp(conf->ip_mode, "tun") == 0 && tunif_conf.queues > 1) {
+        fork_shards(tunif_conf.queues);
+    }
+#endif
+
     udp_raw_init();
     tcp_raw_init();
 
@@ -309,8 +469,17 @@ main(int argc, char **argv) {
     }
     struct ev_loop *loop = ev_default_loop(0);
 
+    /* per shard, after the fork */
+    socks5_pool_init(conf->socks_server, conf->socks_port,
+                     conf->socks_pool_size != NULL ? atoi(conf->socks_pool_size) : 0,
+                     conf->socks_pool_max_idle != NULL ? atoi(conf->socks_pool_max_idle) : 0);
+
     struct tuntapif *tuntapif;
     tuntapif = (struct tuntapif *) ((&netif)->state);
+    int tuntap_fd = tuntapif->fd;
+    if (strcmp(conf->ip_mode, "tun") == 0) {
+        tuntap_fd = tunif_io_start(&netif);
+    }
 
     /**
      * signal start
@@ -325,6 +494,11 @@ main(int argc, char **argv) {
     ev_signal_init(&signal_int_watcher, sigint_cb, SIGINT);
     ev_signal_start(loop, &signal_int_watcher);
 
+    // dump stats
+    ev_signal signal_usr1_watcher;
+    ev_signal_init(&signal_usr1_watcher, sigusr1_cb, SIGUSR1);
+    ev_signal_start(loop, &signal_usr1_watcher);
+
     ev_signal signal_usr2_watcher;
     ev_signal_init(&signal_usr2_watcher, sigusr2_cb, SIGUSR2);
     ev_signal_start(loop, &signal_usr2_watcher);
@@ -332,17 +506,25 @@ main(int argc, char **argv) {
      * signal end
      */
 
-    ev_io_init(tuntap_io, tuntap_read_cb, tuntapif->fd, EV_READ);
+    ev_io_init(tuntap_io, tuntap_read_cb, tuntap_fd, EV_READ);
     ev_io_start(loop, tuntap_io);
 
 
-    // TODO
+    /**
+     * lwip timers: tcp retransmit, delayed ack, keepalive, ip reassembly
+     */
+    ev_init(&lwip_timer, lwip_timer_cb);
+    ev_prepare_init(&lwip_prepare, lwip_prepare_cb);
+    ev_prepare_start(loop, &lwip_prepare);
+
     sys_check_timeouts();
 
     /**
      * setup shell scripts
      */
-    on_shell();
+    if (shard_id == 0) {
+        on_shell();
+    }
 
     std::cout << "Ip2socks started!" << std::endl;
     return ev_run(loop, 0);
@@ -352,7 +534,7 @@ main(int argc, char **argv) {
  * down shell scripts
  */
 void down_shell() {
-    if (conf->before_shutdown_shell != NULL) {
+    if (shard_id == 0 && conf->before_shutdown_shell != NULL) {
         std::string sh("sh ");
         sh.append(conf->before_shutdown_shell);
         sh.append(" ");
@@ -392,6 +574,7 @@ void on_shell() {
 
 void sigterm_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
     printf("SIGTERM handler called in process!!!\n");
+    stop_shards();
     down_shell();
     ev_break(loop, EVBREAK_ALL);
     exit(0); // kill all threads
@@ -399,21 +582,122 @@ void sigterm_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
 
 void sigint_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
     printf("SIGINT handler called in process!!!\n");
+    stop_shards();
     down_shell();
     ev_break(loop, EVBREAK_ALL);
     exit(0); // kill all threads
 }
 
+void sigusr1_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
+    stats_dump(stdout);
+}
+
 void sigusr2_cb(struct ev_loop *loop, ev_signal *watcher, int revents) {
     printf("SIGUSR2 handler called in process!!! TODO reload config.\n");
 }
 
 void tuntap_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
     if (strcmp(conf->ip_mode, "tun") == 0) {
-        tunif_input(&netif);
+        tunif_input(&netif, tuntap_read_budget, tuntap_read_budget_bytes);
     } else {
 #if defined(LWIP_UNIX_LINUX)
-        tapif_input(&netif);
+        tapif_input(&netif, tuntap_read_budget, tuntap_read_budget_bytes);
 #endif
     }
 }
+
+void lwip_timer_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    s32_t late = (s32_t) (sys_now() - lwip_timer_due);
+
+    stats.lwip_timer_runs++;
+    if (late > 0) {
+        stats.lwip_timer_late++;
+        stats.lwip_timer_late_ms += late;
+        if ((u32_t) late > stats.lwip_timer_late_max_ms) {
+            stats.lwip_timer_late_max_ms = (u32_t) late;
+        }
+    }
+
+    sys_check_timeouts();
+}
+
+/**
+ * callbacks run during the last iteration may have added or moved lwip timeouts,
+ * so follow sys_timeouts_sleeptime() right before the loop blocks again.
+ * tun io_uring reads and writes queued by them go to the kernel in one submit here,
+ * as do the datagrams they queued for the udp relays
+ */
+void lwip_prepare_cb(struct ev_loop *loop, ev_prepare *watcher, int revents) {
+    udp_raw_flush();
+    if (strcmp(conf->ip_mode, "tun") == 0) {
+        tunif_flush(&netif);
+    }
+
+    u32_t sleeptime = sys_timeouts_sleeptime();
+
+    if (sleeptime == SYS_TIMEOUTS_SLEEPTIME_INFINITE) {
+        ev_timer_stop(loop, &lwip_timer);
+        return;
+    }
+
+    u32_t due = sys_now() + sleeptime;
+    if (ev_is_active(&lwip_timer) && due == lwip_timer_due) {
+        return;
+    }
+
+    lwip_timer_due = due;
+    ev_timer_stop(loop, &lwip_timer);
+    ev_timer_set(&lwip_timer, sleeptime / 1000., 0.);
+    ev_timer_start(loop, &lwip_timer);
+}
+
+/**
+ * attach queues 1..n-1 and fork a worker for each, the parent keeps queue 0
+ * must run after netif_add and before the event loop is created
+ */
+void fork_shards(int queues) {
+#if defined(LWIP_UNIX_LINUX)
+    std::vector<int> fds;
+    for (int i = 1; i < queues; ++i) {
+        int fd = tunif_open_queue(&netif);
+        if (fd < 0) {
+            printf("open tun queue %d failed, run with %d queues\n", i, i);
+            break;
+        }
+        fds.push_back(fd);
+    }
+
+    fflush(stdout);
+    for (size_t i = 0; i < fds.size(); ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork shard failed");
+            close(fds.at(i));
+            continue;
+        }
+        if (pid == 0) {
+            // worker: keep only its own queue, die with the parent
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            shard_id = (int) i + 1;
+            shard_pids.clear();
+            close(((struct tuntapif *) netif.state)->fd);
+            for (size_t j = 0; j < fds.size(); ++j) {
+                if (j != i) {
+                    close(fds.at(j));
+                }
+            }
+            tunif_use_queue(&netif, fds.at(i));
+            printf("shard %d started, pid %d\n", shard_id, getpid());
+            return;
+        }
+        shard_pids.push_back(pid);
+        close(fds.at(i));
+    }
+#endif
+}
+
+void stop_shards() {
+    for (size_t i = 0; i < shard_pids.size(); ++i) {
+        kill(shard_pids.at(i), SIGTERM);
+    }
+}
@@ -8,3 +8,38 @@ int setnonblocking(int fd) {
     }
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
+
+int setblocking(int fd) {
+    int flags;
+    if (-1 == (flags = fcntl(fd, F_GETFL, 0))) {
+        flags = 0;
+    }
+    return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+/**
+ * one iovec per non-empty pbuf of the chain, starting offset bytes in,
+ * -1 if the chain needs more than iovcnt
+ */
+int pbuf_to_iovec(const struct pbuf *p, u16_t offset, struct iovec *iov, int iovcnt) {
+    int n = 0;
+    const struct pbuf *q;
+
+    for (q = p; q != NULL; q = q->next) {
+        if (offset >= q->len) {
+            offset -= q->len;
+            continue;
+        }
+        if (n == iovcnt) {
+            return -1;
+        }
+        iov[n].iov_base = (char *) q->payload + offset;
+        iov[n].iov_len = q->len - offset;
+        offset = 0;
+        n++;
+        if (q->tot_len == q->len) {
+            break;
+        }
+    }
+    return n;
+}
@@ -1,12 +1,23 @@
 #ifndef LWIP_SOCKET_UTIL_H
 #define LWIP_SOCKET_UTIL_H
 
+#include <sys/uio.h>
+
+#include "lwip/pbuf.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* max iovec entries used for one packet, longer chains are flattened */
+#define PBUF_IOV_MAX 64
+
 int setnonblocking(int fd);
 
+int setblocking(int fd);
+
+int pbuf_to_iovec(const struct pbuf *p, u16_t offset, struct iovec *iov, int iovcnt);
+
 #ifdef __cplusplus
 }
 #endif
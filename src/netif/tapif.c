@@ -1,6 +1,7 @@
 /**
  * based on lwip-contrib
  */
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -20,6 +21,7 @@
 
 #include "netif/tapif.h"
 #include "netif/socket_util.h"
+#include "stats.h"
 
 #define IFCONFIG_BIN "/sbin/ifconfig "
 
@@ -63,7 +65,7 @@ struct tapif {
 };
 
 /* Forward declarations. */
-void tapif_input(struct netif *netif);
+int tapif_input(struct netif *netif, int max_packets, int max_bytes);
 
 int tap_create(char *dev) {
     int fd = -1;
@@ -176,7 +178,9 @@ low_level_init(struct netif *netif) {
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p) {
     struct tapif *tapif = (struct tapif *) netif->state;
-    char buf[1514];
+    static char buf[0xffff];
+    struct iovec iov[PBUF_IOV_MAX];
+    int iovcnt;
     ssize_t written;
 
 #if 0
@@ -187,10 +191,17 @@ low_level_output(struct netif *netif, struct pbuf *p) {
 #endif
 
     /* initiate transfer(); */
-    pbuf_copy_partial(p, buf, p->tot_len, 0);
+    /* one iovec per pbuf, only flatten chains too long for that */
+    iovcnt = pbuf_to_iovec(p, 0, iov, PBUF_IOV_MAX);
+    if (iovcnt < 0) {
+        pbuf_copy_partial(p, buf, p->tot_len, 0);
+        iov[0].iov_base = buf;
+        iov[0].iov_len = p->tot_len;
+        iovcnt = 1;
+    }
 
     /* signal that packet should be sent(); */
-    written = write(tapif->fd, buf, p->tot_len);
+    written = writev(tapif->fd, iov, iovcnt);
     if (written == -1) {
         MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
         perror("tapif: write");
@@ -211,16 +222,19 @@ low_level_output(struct netif *netif, struct pbuf *p) {
 static struct pbuf *
 low_level_input(struct netif *netif) {
     struct pbuf *p;
-    u16_t len;
+    ssize_t len;
     char buf[1514];
     struct tapif *tapif = (struct tapif *) netif->state;
 
     /* Obtain the size of the packet and put it into the "len"
        variable. */
     len = read(tapif->fd, buf, sizeof(buf));
-    if (len == (u16_t) -1) {
-        perror("read returned -1");
-        exit(1);
+    if (len <= 0) {
+        /* drained, EAGAIN */
+        if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("tapif: read");
+        }
+        return NULL;
     }
 
     MIB2_STATS_NETIF_ADD(netif, ifinoctets, len);
@@ -233,9 +247,9 @@ low_level_input(struct netif *netif) {
 #endif
 
     /* We allocate a pbuf chain of pbufs from the pool. */
-    p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+    p = pbuf_alloc(PBUF_RAW, (u16_t) len, PBUF_POOL);
     if (p != NULL) {
-        pbuf_take(p, buf, len);
+        pbuf_take(p, buf, (u16_t) len);
         /* acknowledge that packet has been read(); */
     } else {
         /* drop packet(); */
@@ -257,23 +271,33 @@ low_level_input(struct netif *netif) {
  *
  */
 /*-----------------------------------------------------------------------------------*/
-void
-tapif_input(struct netif *netif) {
-    struct pbuf *p = low_level_input(netif);
+int
+tapif_input(struct netif *netif, int max_packets, int max_bytes) {
+    struct pbuf *p;
+    int packets = 0, bytes = 0;
+
+    while (packets < max_packets && bytes < max_bytes) {
+        p = low_level_input(netif);
 
-    if (p == NULL) {
+        if (p == NULL) {
 #if LINK_STATS
-        LINK_STATS_INC(link.recv);
+            LINK_STATS_INC(link.recv);
 #endif /* LINK_STATS */
-        LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_input: low_level_input returned NULL\n"));
-        return;
+            LWIP_DEBUGF(TAPIF_DEBUG, ("tapif_input: low_level_input returned NULL\n"));
+            break;
+        }
+        packets++;
+        bytes += p->tot_len;
+
+        err_t err = netif->input(p, netif);
+        if (err != ERR_OK) {
+            printf("============================> tapif_input: netif input error %d\n", err);
+            pbuf_free(p);
+        }
     }
 
-    err_t err = netif->input(p, netif);
-    if (err != ERR_OK) {
-        printf("============================> tapif_input: netif input error %d\n", err);
-        pbuf_free(p);
-    }
+    stats_tun_rx(packets, bytes, packets >= max_packets || bytes >= max_bytes);
+    return packets;
 }
 /*-----------------------------------------------------------------------------------*/
 /*
@@ -13,7 +13,8 @@ extern "C" {
 err_t tapif_init(struct netif *netif);
 
 #if NO_SYS
-void tapif_input(struct netif *netif);
+/* read until EAGAIN or until max_packets / max_bytes is used up, return packets read */
+int tapif_input(struct netif *netif, int max_packets, int max_bytes);
 #endif /* NO_SYS */
 
 #ifdef __cplusplus
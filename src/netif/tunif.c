@@ -3,12 +3,15 @@
  */
 #include "netif/tunif.h"
 #include "netif/socket_util.h"
+#include "netif/uring.h"
+#include "stats.h"
 
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 
 #include "lwip/ip.h"
+#include "lwip/prot/tcp.h"
 
 
 #if LWIP_IPV4 /* @todo: IPv6 */
@@ -25,7 +28,12 @@
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 
 #ifndef DEVTUN
@@ -34,6 +42,7 @@
 
 #define IP_ADDR_ARGS "addr add %d.%d.%d.%d/24 dev %s"
 #define IP_UP_ARGS "link set %s up"
+#define IP_MTU_ARGS "link set %s mtu %d"
 #define IP_BIN "/sbin/ip "
 #elif defined(LWIP_UNIX_OPENBSD)
 #define DEVTUN "/dev/tun0"
@@ -58,18 +67,92 @@
 
 #define IFCONFIG_BIN "/sbin/ifconfig "
 
+/* default link mtu */
+#define BUFFER_SIZE 1500
+#define TUNIF_MTU_MIN 576
+
+/**
+ * receive buffer, the tun device reads straight into data and lwip gets it
+ * as a custom pbuf, tunif_rxbuf_free puts it back on the free list
+ */
+struct tunif_rxbuf {
+    struct pbuf_custom pc;
+    struct tunif *tunif;
+    struct tunif_rxbuf *next;
+    int slot; // io_uring read slot, -1 for pooled buffers
+    char data[];
+};
+
+/* keep at most this many bytes of idle receive buffers around */
+#define RXBUF_FREE_BYTES (4 * 1024 * 1024)
+
+/* ip + tcp headers with options */
+#define TUNIF_HDR_MAX 120
+
+#if defined(HAVE_LINUX_IO_URING_H)
+/* reads kept in flight and writes queued per ring, both fit the cq of TUNIF_URING_ENTRIES */
+#define TUNIF_URING_ENTRIES 256
+#define TUNIF_URING_RX 64
+#define TUNIF_URING_TX 128
+
+/* low bit of user_data, rx and tx completions carry their buffer pointer */
+#define TUNIF_URING_TX_TAG 1
+/* user_data of the POLLIN parked reads wait on */
+#define TUNIF_URING_POLL_TAG 2
+
+/**
+ * an outgoing packet owned by the ring until its completion, holds a pbuf
+ * reference and everything the iovecs point to
+ */
+struct tunif_txslot {
+    struct tunif_txslot *next;
+    struct pbuf *p;
+    struct iovec iov[PBUF_IOV_MAX + 2];
+    struct virtio_net_hdr vnet;
+    u8_t hdr[TUNIF_HDR_MAX];
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
 struct tunif {
     int fd;
+    char name[16];
+    int queues;
+    int vnet_hdr; // every packet is prefixed with a struct virtio_net_hdr
+    u16_t link_mtu; // mtu of the tun device, gso_size is derived from it
+    tunif_tcp_mss_fn tcp_mss; // the peer's mss caps gso_size further
+    int rxbuf_size;
+    struct tunif_rxbuf *rxbuf_free;
+    int rxbuf_free_count;
+    int rxbuf_free_max;
+#if defined(HAVE_LINUX_IO_URING_H)
+    int uring_on; // requested by tunif_conf, cleared by tunif_io_start if the ring fails
+    int uring_rx; // reads go through the ring too, not only the batched writes
+    int uring_fixed_file;
+    int uring_fixed_bufs;
+    struct uring ring;
+    struct tunif_rxbuf *uring_rx_idle; // read slots waiting for a free sqe
+    struct tunif_rxbuf *uring_rx_wait; // read slots that found the fd empty, requeued by the poll
+    int uring_poll_armed;
+    int uring_rx_held; // read slots lwip still references
+    struct tunif_txslot *uring_tx_free;
+    int uring_tx_pending; // writes queued since the last submit
+    int uring_tx_pending_bytes;
+#endif
+    int tx_batch_bytes; // submit early once this much output is queued, 0 writes right away
 };
 
-#define BUFFER_SIZE 1500
-
 /* Forward declarations. */
-void tunif_input(struct netif *netif);
+int tunif_input(struct netif *netif, int max_packets, int max_bytes);
 
 static err_t tunif_output(struct netif *netif, struct pbuf *p,
                           const ip4_addr_t *ipaddr);
 
+#if defined(HAVE_LINUX_IO_URING_H)
+static void tunif_flush_ring(struct tunif *tunif);
+
+static void uring_read(struct tunif *tunif, struct tunif_rxbuf *rx);
+#endif
+
 
 #if defined(LWIP_UNIX_MACH)
 
@@ -80,24 +163,21 @@ static inline int utun_modified_len(int len) {
     return len;
 }
 
-static int utun_write(int fd, void *buf, size_t len) {
+static int utun_writev(int fd, const struct iovec *iov, int iovcnt) {
   u_int32_t type;
-  struct iovec iv[2];
-  struct ip *iph;
-
-  iph = (struct ip *) buf;
+  struct iovec iv[PBUF_IOV_MAX + 1];
 
-  if (iph->ip_v == 6)
+  /* ip version is the high nibble of the first byte */
+  if ((((const u_char *) iov[0].iov_base)[0] >> 4) == 6)
     type = htonl(AF_INET6);
   else
     type = htonl(AF_INET);
 
   iv[0].iov_base = &type;
   iv[0].iov_len = sizeof(type);
-  iv[1].iov_base = buf;
-  iv[1].iov_len = len;
+  memcpy(&iv[1], iov, iovcnt * sizeof(struct iovec));
 
-  return utun_modified_len(writev(fd, iv, 2));
+  return utun_modified_len(writev(fd, iv, iovcnt + 1));
 }
 
 static int utun_read(int fd, void *buf, size_t len) {
@@ -116,7 +196,7 @@ static int utun_read(int fd, void *buf, size_t len) {
 
 #if defined(LWIP_UNIX_MACH)
 #define tun_read(...) utun_read(__VA_ARGS__)
-#define tun_write(...) utun_write(__VA_ARGS__)
+#define tun_writev(...) utun_writev(__VA_ARGS__)
 #endif /* LWIP_UNIX_MACH */
 
 /*-----------------------------------------------------------------------------------*/
@@ -170,7 +250,10 @@ int utun_create(char *dev, u_int32_t unit) {
 
 #endif /* LWIP_UNIX_MACH */
 
-int tun_create(char *dev) {
+/**
+ * dev is the name to attach to, or empty to create a new device; it gets the device name
+ */
+int tun_create(char *dev, int multi_queue, int vnet_hdr) {
     int fd = -1;
 #if defined(LWIP_UNIX_LINUX)
     struct ifreq ifr;
@@ -182,6 +265,17 @@ int tun_create(char *dev) {
 
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+#ifdef IFF_MULTI_QUEUE
+    if (multi_queue) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+#endif
+    if (vnet_hdr) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+    if (dev[0] != '\0') {
+        strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    }
 
     if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
         printf("failed to open tun device\n");
@@ -190,6 +284,20 @@ int tun_create(char *dev) {
     }
     strcpy(dev, ifr.ifr_name);
 
+    if (vnet_hdr) {
+        int hdr_len = sizeof(struct virtio_net_hdr);
+        if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0) {
+            printf("failed to set tun vnet header size\n");
+            close(fd);
+            return -1;
+        }
+        /* let the kernel hand us tso superpackets with partial checksums, ufo is gone from newer kernels */
+        if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_UFO) < 0 &&
+            ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0) {
+            printf("failed to enable tun offloads, receive without gso\n");
+        }
+    }
+
     printf("Open tun device: %s for reading...\n", ifr.ifr_name);
 #endif
 
@@ -226,13 +334,20 @@ low_level_init(struct netif *netif) {
 
     /* Do whatever else is needed to initialize interface. */
 
-    tunif->fd = tun_create(tun_name);
+    tunif->fd = tun_create(tun_name, tunif->queues > 1, tunif->vnet_hdr);
+    if (tunif->fd < 1 && tunif->vnet_hdr) {
+        printf("tun offload not available, open without vnet header\n");
+        tunif->vnet_hdr = 0;
+        tun_name[0] = '\0';
+        tunif->fd = tun_create(tun_name, tunif->queues > 1, 0);
+    }
     if (tunif->fd < 1) {
         perror("tunif_init failed\n");
         exit(1);
     }
 
     printf("tun name is %s\n", tun_name);
+    strncpy(tunif->name, tun_name, sizeof(tunif->name) - 1);
 
 #if defined(LWIP_UNIX_MACH)
     // ifconfig $intf $local_tun_ip $remote_tun_ip mtu $mtu netmask 255.255.255.0 up
@@ -247,7 +362,7 @@ low_level_init(struct netif *netif) {
              ip4_addr2(netif_ip4_gw(netif)),
              ip4_addr3(netif_ip4_gw(netif)),
              ip4_addr4(netif_ip4_gw(netif)),
-             BUFFER_SIZE,
+             tunif->link_mtu,
              ip4_addr1(netif_ip4_netmask(netif)),
              ip4_addr2(netif_ip4_netmask(netif)),
              ip4_addr3(netif_ip4_netmask(netif)),
@@ -263,6 +378,10 @@ low_level_init(struct netif *netif) {
              ip4_addr4(netif_ip4_gw(netif)),
              tun_name);
     ret = system(buf);
+    if (tunif->link_mtu != BUFFER_SIZE) {
+        snprintf(buf, 1024, IP_BIN IP_MTU_ARGS, tun_name, tunif->link_mtu);
+        ret = system(buf);
+    }
     snprintf(buf, 1024, IP_BIN IP_UP_ARGS,
              tun_name);
     ret = system(buf);
@@ -286,21 +405,269 @@ low_level_init(struct netif *netif) {
  */
 /*-----------------------------------------------------------------------------------*/
 
+#if defined(LWIP_UNIX_LINUX)
+/**
+ * folded, not inverted, ipv4 pseudo header sum, what the kernel expects in the
+ * checksum field of a VIRTIO_NET_HDR_F_NEEDS_CSUM packet
+ */
+static u16_t
+pseudo_chksum(const u8_t *iph, u8_t proto, u16_t len) {
+    u16_t w[4];
+    u32_t acc = 0;
+    int i;
+
+    memcpy(w, iph + 12, sizeof(w)); /* src and dst address */
+    for (i = 0; i < 4; i++) {
+        acc += w[i];
+    }
+    acc += lwip_htons(proto);
+    acc += lwip_htons(len);
+    while (acc >> 16) {
+        acc = (acc & 0xffff) + (acc >> 16);
+    }
+    return (u16_t) acc;
+}
+
+/**
+ * fill the vnet header for an outgoing packet, lwip leaves tcp/udp checksums to the
+ * kernel on this netif and tcp segments larger than the link mtu go out as tso
+ *
+ * the ip and transport headers are copied to hdr with the partial checksum patched
+ * in, so the pbuf lwip may retransmit stays untouched. Return the bytes in hdr.
+ */
+/**
+ * lwip advertises an mss from the 64K netif mtu, the client must not send
+ * segments larger than the link takes
+ */
+static void
+vnet_clamp_syn_mss(struct tunif *tunif, u8_t *tcph, u16_t tcph_len) {
+    u16_t max = (u16_t) (tunif->link_mtu - 40);
+    u16_t i = 20;
+
+    if ((tcph[13] & TCP_SYN) == 0) {
+        return;
+    }
+    while (i < tcph_len) {
+        u8_t kind = tcph[i];
+        if (kind == 0) {
+            break;
+        }
+        if (kind == 1) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= tcph_len || tcph[i + 1] < 2) {
+            break;
+        }
+        if (kind == 2 && tcph[i + 1] == 4 && i + 4 <= tcph_len) {
+            u16_t mss = (u16_t) (tcph[i + 2] << 8 | tcph[i + 3]);
+            if (mss > max) {
+                tcph[i + 2] = (u8_t) (max >> 8);
+                tcph[i + 3] = (u8_t) max;
+            }
+            break;
+        }
+        i = (u16_t) (i + tcph[i + 1]);
+    }
+}
+
+static u16_t
+vnet_tx_prepare(struct tunif *tunif, struct pbuf *p, struct virtio_net_hdr *vnet, u8_t *hdr) {
+    u16_t iph_len, hdr_len, csum_off;
+    u8_t proto;
+
+    memset(vnet, 0, sizeof(struct virtio_net_hdr));
+
+    if (pbuf_copy_partial(p, hdr, 20, 0) != 20 || (hdr[0] >> 4) != 4) {
+        return 0; /* ipv6 TODO */
+    }
+    iph_len = (u16_t) ((hdr[0] & 0x0f) * 4);
+    proto = hdr[9];
+    if ((hdr[6] & 0x3f) != 0 || hdr[7] != 0) {
+        return 0; /* fragment */
+    }
+
+    if (proto == IP_PROTO_TCP) {
+        csum_off = 16;
+        if (pbuf_copy_partial(p, hdr, iph_len + 20, 0) != iph_len + 20) {
+            return 0;
+        }
+        hdr_len = (u16_t) (iph_len + (hdr[iph_len + 12] >> 4) * 4);
+    } else if (proto == IP_PROTO_UDP) {
+        csum_off = 6;
+        hdr_len = (u16_t) (iph_len + 8);
+    } else {
+        return 0;
+    }
+    if (hdr_len > TUNIF_HDR_MAX || pbuf_copy_partial(p, hdr, hdr_len, 0) != hdr_len) {
+        return 0;
+    }
+
+    if (proto == IP_PROTO_TCP) {
+        /* the kernel sums the copy, the option can be patched in place */
+        vnet_clamp_syn_mss(tunif, hdr + iph_len, (u16_t) (hdr_len - iph_len));
+    }
+
+    u16_t sum = pseudo_chksum(hdr, proto, (u16_t) (p->tot_len - iph_len));
+    memcpy(hdr + iph_len + csum_off, &sum, sizeof(sum));
+
+    vnet->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vnet->csum_start = iph_len;
+    vnet->csum_offset = csum_off;
+    if (proto == IP_PROTO_TCP) {
+        /* lwip builds segments up to TUNIF_TSO_MSS, the kernel cuts them at the mss the client negotiated */
+        u16_t gso_size = (u16_t) (tunif->link_mtu - hdr_len);
+        if (tunif->tcp_mss != NULL) {
+            u32_t src, dst;
+            u16_t sport, dport;
+            memcpy(&src, hdr + 12, 4);
+            memcpy(&dst, hdr + 16, 4);
+            memcpy(&sport, hdr + iph_len, 2);
+            memcpy(&dport, hdr + iph_len + 2, 2);
+            u16_t mss = tunif->tcp_mss(src, lwip_ntohs(sport), dst, lwip_ntohs(dport));
+            if (mss > 0 && mss < gso_size) {
+                gso_size = mss;
+            }
+        }
+        if (p->tot_len - hdr_len > gso_size) {
+            vnet->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            vnet->hdr_len = hdr_len;
+            vnet->gso_size = gso_size;
+            stats.tun_tx_gso_packets++;
+        }
+    }
+    return hdr_len;
+}
+#endif /* LWIP_UNIX_LINUX */
+
+/**
+ * iovecs for what goes in front of the pbuf data, the vnet header and the patched
+ * header copy, offset is set to the pbuf bytes the copy replaces
+ */
+static int
+tx_header_iovec(struct tunif *tunif, struct pbuf *p, struct iovec *iov,
+                void *vnet, u8_t *hdr, u16_t *offset) {
+    int iovcnt = 0;
+
+    *offset = 0;
+#if defined(LWIP_UNIX_LINUX)
+    if (tunif->vnet_hdr) {
+        *offset = vnet_tx_prepare(tunif, p, (struct virtio_net_hdr *) vnet, hdr);
+        iov[iovcnt].iov_base = vnet;
+        iov[iovcnt].iov_len = sizeof(struct virtio_net_hdr);
+        iovcnt++;
+        if (*offset > 0) {
+            iov[iovcnt].iov_base = hdr;
+            iov[iovcnt].iov_len = *offset;
+            iovcnt++;
+        }
+    }
+#endif
+    return iovcnt;
+}
+
+#if defined(HAVE_LINUX_IO_URING_H)
+/**
+ * queue the packet as a writev sqe, submitted by tunif_flush. Return -1 if it
+ * must go out synchronously: no free slot or a chain longer than the iovecs.
+ */
+static int
+uring_output(struct tunif *tunif, struct pbuf *p) {
+    struct tunif_txslot *tx = tunif->uring_tx_free;
+    struct io_uring_sqe *sqe;
+    u16_t offset;
+    int iovcnt, n;
+
+    if (tx == NULL && !tunif->uring_rx) {
+        /* nothing else reaps write completions in this mode */
+        tunif_flush_ring(tunif);
+        tx = tunif->uring_tx_free;
+    }
+    if (tx == NULL || pbuf_clen(p) > PBUF_IOV_MAX) {
+        return -1;
+    }
+
+    iovcnt = tx_header_iovec(tunif, p, tx->iov, &tx->vnet, tx->hdr, &offset);
+    n = pbuf_to_iovec(p, offset, tx->iov + iovcnt, PBUF_IOV_MAX);
+    if (n < 0) {
+        return -1;
+    }
+    iovcnt += n;
+
+    sqe = uring_get_sqe(&tunif->ring);
+    if (sqe == NULL) {
+        /* sq full, hand the batch over and retry */
+        tunif_flush_ring(tunif);
+        sqe = uring_get_sqe(&tunif->ring);
+    }
+    if (sqe == NULL) {
+        stats.tun_tx_syscalls++;
+        if (writev(tunif->fd, tx->iov, iovcnt) == -1) {
+            perror("tunif: write failed\n");
+        }
+        return 0;
+    }
+
+    tunif->uring_tx_free = tx->next;
+    pbuf_ref(p);
+    tx->p = p;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = tunif->uring_fixed_file ? 0 : tunif->fd;
+    sqe->flags = tunif->uring_fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uint64_t) (uintptr_t) tx->iov;
+    sqe->len = (u32_t) iovcnt;
+    sqe->user_data = (uint64_t) (uintptr_t) tx | TUNIF_URING_TX_TAG;
+
+    tunif->uring_tx_pending++;
+    tunif->uring_tx_pending_bytes += p->tot_len;
+    if (tunif->uring_tx_pending_bytes >= tunif->tx_batch_bytes) {
+        tunif_flush_ring(tunif);
+    }
+    return 0;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
 static err_t
 low_level_output(struct tunif *tunif, struct pbuf *p) {
-    char buf[BUFFER_SIZE];
+    static char buf[0xffff];
+    struct iovec iov[PBUF_IOV_MAX + 2];
+    int iovcnt, n;
+    u16_t offset;
     int ret;
+#if defined(LWIP_UNIX_LINUX)
+    struct virtio_net_hdr vnet;
+#else
+    char vnet;
+#endif
+    u8_t hdr[TUNIF_HDR_MAX];
 
-    /* initiate transfer(); */
+    stats.tun_tx_packets++;
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (tunif->uring_on && uring_output(tunif, p) == 0) {
+        return ERR_OK;
+    }
+#endif
 
-    pbuf_copy_partial(p, buf, p->tot_len, 0);
+    /* initiate transfer(); */
+    iovcnt = tx_header_iovec(tunif, p, iov, &vnet, hdr, &offset);
+
+    /* one iovec per pbuf, only flatten chains too long for that */
+    n = pbuf_to_iovec(p, offset, iov + iovcnt, PBUF_IOV_MAX);
+    if (n < 0) {
+        pbuf_copy_partial(p, buf, p->tot_len - offset, offset);
+        iov[iovcnt].iov_base = buf;
+        iov[iovcnt].iov_len = p->tot_len - offset;
+        n = 1;
+    }
+    iovcnt += n;
 
     /* signal that packet should be sent(); */
+    stats.tun_tx_syscalls++;
 #if defined(LWIP_UNIX_MACH)
-    ret = tun_write(tunif->fd, buf, p->tot_len);
+    ret = tun_writev(tunif->fd, iov, iovcnt);
 #endif
 #if defined(LWIP_UNIX_LINUX)
-    ret = write(tunif->fd, buf, p->tot_len);
+    ret = writev(tunif->fd, iov, iovcnt);
 #endif
     if (ret == -1) {
         perror("tunif: write failed\n");
@@ -316,39 +683,364 @@ low_level_output(struct tunif *tunif, struct pbuf *p) {
  *
  */
 /*-----------------------------------------------------------------------------------*/
+static void
+tunif_rxbuf_free(struct pbuf *p) {
+    struct tunif_rxbuf *rx = (struct tunif_rxbuf *) p;
+    struct tunif *tunif = rx->tunif;
+
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (rx->slot >= 0) {
+        /* ring buffers are registered with the kernel, read into it again */
+        tunif->uring_rx_held--;
+        uring_read(tunif, rx);
+        return;
+    }
+#endif
+    if (tunif->rxbuf_free_count >= tunif->rxbuf_free_max) {
+        free(rx);
+        return;
+    }
+    rx->next = tunif->rxbuf_free;
+    tunif->rxbuf_free = rx;
+    tunif->rxbuf_free_count++;
+}
+
+static struct tunif_rxbuf *
+tunif_rxbuf_get(struct tunif *tunif) {
+    struct tunif_rxbuf *rx = tunif->rxbuf_free;
+
+    if (rx != NULL) {
+        tunif->rxbuf_free = rx->next;
+        tunif->rxbuf_free_count--;
+        return rx;
+    }
+
+    rx = (struct tunif_rxbuf *) malloc(sizeof(struct tunif_rxbuf) + tunif->rxbuf_size);
+    if (rx != NULL) {
+        rx->tunif = tunif;
+        rx->slot = -1;
+        rx->pc.custom_free_function = tunif_rxbuf_free;
+    }
+    return rx;
+}
+
+/**
+ * wrap len bytes read into rx as a pbuf, rx goes back to its owner on failure
+ */
 static struct pbuf *
-low_level_input(struct tunif *tunif) {
+rxbuf_to_pbuf(struct tunif *tunif, struct tunif_rxbuf *rx, ssize_t len) {
     struct pbuf *p;
+    u16_t hdr_len = 0;
+
+#if defined(LWIP_UNIX_LINUX)
+    if (tunif->vnet_hdr) {
+        hdr_len = sizeof(struct virtio_net_hdr);
+    }
+#endif
+    if ((len <= hdr_len) || (len - hdr_len > 0xffff)) {
+        tunif_rxbuf_free(&rx->pc.pbuf);
+        return NULL;
+    }
+
+#if defined(LWIP_UNIX_LINUX)
+    if (tunif->vnet_hdr) {
+        struct virtio_net_hdr *vnet = (struct virtio_net_hdr *) rx->data;
+
+        /*
+         * tso superpackets go into lwip as one large segment, lwip does not verify
+         * tcp/udp checksums on this netif so partial ones need no completing
+         */
+        if (vnet->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            stats.tun_rx_gso_packets++;
+        }
+    }
+#endif
+
+    /* No copy, the pbuf references the receive buffer. */
+    p = pbuf_alloced_custom(PBUF_RAW, (u16_t) (len - hdr_len), PBUF_REF, &rx->pc, rx->data + hdr_len,
+                            (u16_t) LWIP_MIN(tunif->rxbuf_size - hdr_len, 0xffff));
+    if (p == NULL) {
+        /* drop packet(); */
+        printf("pbuf_alloced_custom failed\n");
+        tunif_rxbuf_free(&rx->pc.pbuf);
+        return NULL;
+    }
+
+    return p;
+}
+
+static struct pbuf *
+low_level_input(struct tunif *tunif) {
+    struct tunif_rxbuf *rx;
     ssize_t len;
-    char buf[BUFFER_SIZE];
+
+    rx = tunif_rxbuf_get(tunif);
+    if (rx == NULL) {
+        /* drop packet(); */
+        printf("tunif: out of memory for rx buffer\n");
+        return NULL;
+    }
 
     /* Obtain the size of the packet and put it into the "len"
        variable. */
 #if defined(LWIP_UNIX_MACH)
-    len = tun_read(tunif->fd, buf, sizeof(buf));
+    len = tun_read(tunif->fd, rx->data, tunif->rxbuf_size);
 #endif /* LWIP_UNIX_MACH */
 #if defined(LWIP_UNIX_LINUX)
-    len = read(tunif->fd, buf, sizeof(buf));
+    len = read(tunif->fd, rx->data, tunif->rxbuf_size);
 #endif
-    if ((len <= 0) || (len > 0xffff)) {
+    if (len <= 0) {
+        tunif_rxbuf_free(&rx->pc.pbuf);
         return NULL;
     }
 
-    /* We allocate a pbuf chain of pbufs from the pool. */
-    p = pbuf_alloc(PBUF_LINK, (u16_t) len, PBUF_POOL);
+    return rxbuf_to_pbuf(tunif, rx, len);
+}
+
+#if defined(HAVE_LINUX_IO_URING_H)
+/**
+ * queue a read into the ring slot rx, it waits on uring_rx_idle if the sq is full
+ */
+static void
+uring_read(struct tunif *tunif, struct tunif_rxbuf *rx) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&tunif->ring);
+
+    if (sqe == NULL) {
+        rx->next = tunif->uring_rx_idle;
+        tunif->uring_rx_idle = rx;
+        return;
+    }
 
-    if (p != NULL) {
-        pbuf_take(p, buf, (u16_t) len);
-        /* acknowledge that packet has been read(); */
+    if (tunif->uring_fixed_bufs) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = (u16_t) rx->slot;
     } else {
-        /* drop packet(); */
-        printf("pbuf_alloc failed\n");
-        return NULL;
+        sqe->opcode = IORING_OP_READ;
     }
+    sqe->fd = tunif->uring_fixed_file ? 0 : tunif->fd;
+    sqe->flags = tunif->uring_fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uint64_t) (uintptr_t) rx->data;
+    sqe->len = (u32_t) tunif->rxbuf_size;
+    sqe->user_data = (uint64_t) (uintptr_t) rx;
+}
 
-    return p;
+/**
+ * the tun fd stays non-blocking and an empty read completes with -EAGAIN,
+ * park the slot until a POLLIN on the fd fires
+ */
+static void
+uring_read_wait(struct tunif *tunif, struct tunif_rxbuf *rx) {
+    if (!tunif->uring_poll_armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&tunif->ring);
+
+        if (sqe == NULL) {
+            /* sq full, the read idles until the next flush */
+            uring_read(tunif, rx);
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = tunif->uring_fixed_file ? 0 : tunif->fd;
+        sqe->flags = tunif->uring_fixed_file ? IOSQE_FIXED_FILE : 0;
+        sqe->poll_events = POLLIN;
+        sqe->user_data = TUNIF_URING_POLL_TAG;
+        tunif->uring_poll_armed = 1;
+    }
+    rx->next = tunif->uring_rx_wait;
+    tunif->uring_rx_wait = rx;
+}
+
+static void
+uring_tx_done(struct tunif *tunif, struct tunif_txslot *tx, s32_t res) {
+    if (res < 0) {
+        printf("tunif: write failed: %s\n", strerror(-res));
+    }
+    pbuf_free(tx->p);
+    tx->p = NULL;
+    tx->next = tunif->uring_tx_free;
+    tunif->uring_tx_free = tx;
+}
+
+static void
+tunif_flush_ring(struct tunif *tunif) {
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    while (tunif->uring_rx_idle != NULL) {
+        struct tunif_rxbuf *rx = tunif->uring_rx_idle;
+        tunif->uring_rx_idle = rx->next;
+        uring_read(tunif, rx);
+        if (tunif->uring_rx_idle == rx) {
+            break; /* sq still full */
+        }
+    }
+
+    if (uring_sq_ready(&tunif->ring) > 0) {
+        ret = uring_submit(&tunif->ring);
+        if (ret < 0) {
+            perror("tunif: io_uring submit failed");
+            return;
+        }
+        stats.tun_uring_submits++;
+        stats.tun_uring_sqes += ret;
+        if (tunif->uring_tx_pending > 0) {
+            stats.tun_tx_syscalls++;
+        }
+        tunif->uring_tx_pending = 0;
+        tunif->uring_tx_pending_bytes = 0;
+    }
+
+    if (!tunif->uring_rx) {
+        /* only writes on the ring, tun writes mostly complete inside the submit */
+        while ((cqe = uring_peek_cqe(&tunif->ring)) != NULL) {
+            struct tunif_txslot *tx = (struct tunif_txslot *) (uintptr_t) (cqe->user_data & ~(uint64_t) TUNIF_URING_TX_TAG);
+            s32_t res = cqe->res;
+
+            uring_cqe_seen(&tunif->ring);
+            uring_tx_done(tunif, tx, res);
+        }
+    }
+}
+
+/**
+ * reap completions, writes just release their slot, return the next packet read
+ * or NULL once the cq is empty
+ */
+static struct pbuf *
+uring_input(struct tunif *tunif) {
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_peek_cqe(&tunif->ring)) != NULL) {
+        uint64_t user_data = cqe->user_data;
+        s32_t res = cqe->res;
+
+        uring_cqe_seen(&tunif->ring);
+
+        if (user_data & TUNIF_URING_TX_TAG) {
+            struct tunif_txslot *tx = (struct tunif_txslot *) (uintptr_t) (user_data & ~(uint64_t) TUNIF_URING_TX_TAG);
+
+            uring_tx_done(tunif, tx, res);
+            continue;
+        }
+
+        if (user_data == TUNIF_URING_POLL_TAG) {
+            tunif->uring_poll_armed = 0;
+            while (tunif->uring_rx_wait != NULL) {
+                struct tunif_rxbuf *rx = tunif->uring_rx_wait;
+                tunif->uring_rx_wait = rx->next;
+                uring_read(tunif, rx);
+            }
+            continue;
+        }
+
+        struct tunif_rxbuf *rx = (struct tunif_rxbuf *) (uintptr_t) user_data;
+        if (res < 0 && res != -EAGAIN && res != -EINTR) {
+            /* the slot must not get lost, read again once the fd polls ready instead of spinning */
+            printf("tunif: read failed: %s (errno %d)\n", strerror(-res), -res);
+            uring_read_wait(tunif, rx);
+            continue;
+        }
+        if (res == -EAGAIN) {
+            uring_read_wait(tunif, rx);
+            continue;
+        }
+        if (res <= 0) {
+            uring_read(tunif, rx);
+            continue;
+        }
+        if (tunif->uring_rx_held >= TUNIF_URING_RX / 2) {
+            /*
+             * tcp keeps pbufs until the upstream socket drains them, slow flows
+             * must not hold every read slot, copy out and read into it again
+             */
+            struct tunif_rxbuf *copy = tunif_rxbuf_get(tunif);
+            if (copy != NULL) {
+                memcpy(copy->data, rx->data, (size_t) res);
+                uring_read(tunif, rx);
+                rx = copy;
+            }
+        }
+        if (rx->slot >= 0) {
+            tunif->uring_rx_held++;
+        }
+        struct pbuf *p = rxbuf_to_pbuf(tunif, rx, res);
+        if (p != NULL) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * cq drained: consume the eventfd wakeup, completions that raced in keep it set
+ */
+static void
+uring_input_done(struct tunif *tunif) {
+    eventfd_t v;
+
+    eventfd_read(tunif->ring.event_fd, &v);
+    if (uring_peek_cqe(&tunif->ring) != NULL) {
+        eventfd_write(tunif->ring.event_fd, 1);
+    }
 }
 
+/**
+ * set up the ring, with uring_rx all reads go through it as well,
+ * otherwise it only batches writes
+ */
+static int
+uring_start(struct tunif *tunif) {
+    struct iovec iov[TUNIF_URING_RX];
+    struct tunif_rxbuf *rx[TUNIF_URING_RX];
+    struct tunif_txslot *tx;
+    int i, nrx = tunif->uring_rx ? TUNIF_URING_RX : 0;
+
+    if (uring_init(&tunif->ring, TUNIF_URING_ENTRIES) < 0) {
+        perror("io_uring setup failed");
+        return -1;
+    }
+
+    for (i = 0; i < nrx; i++) {
+        rx[i] = (struct tunif_rxbuf *) malloc(sizeof(struct tunif_rxbuf) + tunif->rxbuf_size);
+        if (rx[i] == NULL) {
+            while (--i >= 0) {
+                free(rx[i]);
+            }
+            uring_exit(&tunif->ring);
+            return -1;
+        }
+        rx[i]->tunif = tunif;
+        rx[i]->slot = i;
+        rx[i]->pc.custom_free_function = tunif_rxbuf_free;
+        iov[i].iov_base = rx[i]->data;
+        iov[i].iov_len = (size_t) tunif->rxbuf_size;
+    }
+    tx = (struct tunif_txslot *) calloc(TUNIF_URING_TX, sizeof(struct tunif_txslot));
+    if (tx == NULL) {
+        for (i = 0; i < nrx; i++) {
+            free(rx[i]);
+        }
+        uring_exit(&tunif->ring);
+        return -1;
+    }
+    for (i = 0; i < TUNIF_URING_TX; i++) {
+        tx[i].next = tunif->uring_tx_free;
+        tunif->uring_tx_free = &tx[i];
+    }
+
+    /* both are optional, plain fds and buffers still batch */
+    tunif->uring_fixed_file = uring_register_files(&tunif->ring, &tunif->fd, 1) == 0;
+    tunif->uring_fixed_bufs = nrx > 0 && uring_register_buffers(&tunif->ring, iov, (unsigned) nrx) == 0;
+    printf("tun io_uring: %s, fixed file %s, fixed buffers %s\n", nrx > 0 ? "reads and writes" : "batched writes",
+           tunif->uring_fixed_file ? "yes" : "no", tunif->uring_fixed_bufs ? "yes" : "no");
+
+    for (i = 0; i < nrx; i++) {
+        uring_read(tunif, rx[i]);
+    }
+    tunif_flush_ring(tunif);
+    return 0;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
 /*-----------------------------------------------------------------------------------*/
 /*
  * tunif_output():
@@ -381,25 +1073,41 @@ tunif_output(struct netif *netif, struct pbuf *p,
  *
  */
 /*-----------------------------------------------------------------------------------*/
-void
-tunif_input(struct netif *netif) {
+int
+tunif_input(struct netif *netif, int max_packets, int max_bytes) {
     struct tunif *tunif;
     struct pbuf *p;
+    int packets = 0, bytes = 0;
 
     tunif = (struct tunif *) netif->state;
 
-    p = low_level_input(tunif);
-
-    if (p == NULL) {
-        LWIP_DEBUGF(TUNIF_DEBUG, ("tunif_input: low_level_input returned NULL\n"));
-        return;
+    while (packets < max_packets && bytes < max_bytes) {
+#if defined(HAVE_LINUX_IO_URING_H)
+        if (tunif->uring_rx) {
+            p = uring_input(tunif);
+            if (p == NULL) {
+                uring_input_done(tunif);
+            }
+        } else
+#endif
+        p = low_level_input(tunif);
+
+        if (p == NULL) {
+            LWIP_DEBUGF(TUNIF_DEBUG, ("tunif_input: low_level_input returned NULL\n"));
+            break;
+        }
+        packets++;
+        bytes += p->tot_len;
+
+        err_t err = netif->input(p, netif);
+        if (err != ERR_OK) {
+            printf("============================> tapif_input: netif input error %s\n", lwip_strerr(err));
+            pbuf_free(p);
+        }
     }
 
-    err_t err = netif->input(p, netif);
-    if (err != ERR_OK) {
-        printf("============================> tapif_input: netif input error %s\n", lwip_strerr(err));
-        pbuf_free(p);
-    }
+    stats_tun_rx(packets, bytes, packets >= max_packets || bytes >= max_bytes);
+    return packets;
 }
 /*-----------------------------------------------------------------------------------*/
 /*
@@ -414,19 +1122,144 @@ tunif_input(struct netif *netif) {
 err_t
 tunif_init(struct netif *netif) {
     struct tunif *tunif;
+    struct tunif_conf *tunif_conf = (struct tunif_conf *) netif->state;
 
     tunif = (struct tunif *) mem_malloc(sizeof(struct tunif));
     if (!tunif) {
         return ERR_MEM;
     }
+    memset(tunif, 0, sizeof(struct tunif));
+    tunif->queues = 1;
+    if (tunif_conf != NULL && tunif_conf->queues > 1) {
+        tunif->queues = tunif_conf->queues;
+    }
+#if defined(LWIP_UNIX_LINUX)
+    if (tunif_conf != NULL && tunif_conf->offload) {
+        tunif->vnet_hdr = 1;
+    }
+#endif
+    if (tunif_conf != NULL) {
+        tunif->tx_batch_bytes = tunif_conf->tx_batch_bytes;
+        tunif->tcp_mss = tunif_conf->tcp_mss;
+    }
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (tunif_conf != NULL && tunif_conf->uring) {
+        tunif->uring_on = 1;
+        tunif->uring_rx = 1;
+    } else if (tunif->tx_batch_bytes > 0) {
+        tunif->uring_on = 1;
+    }
+#endif
     netif->state = tunif;
     netif->name[0] = IFNAME0;
     netif->name[1] = IFNAME1;
     netif->output = tunif_output;
+    if (tunif_conf != NULL && tunif_conf->mtu > 0) {
+        netif->mtu = (u16_t) LWIP_MIN(LWIP_MAX(tunif_conf->mtu, TUNIF_MTU_MIN), 0xffff);
+    }
+    if (netif->mtu == 0) {
+        netif->mtu = BUFFER_SIZE;
+    }
+    tunif->link_mtu = netif->mtu;
 
     low_level_init(netif);
+
+    /* a whole packet fits in one receive buffer */
+    tunif->rxbuf_size = netif->mtu;
+#if defined(LWIP_UNIX_LINUX)
+    if (tunif->vnet_hdr) {
+        /*
+         * superpackets both ways, lwip must not fragment large tcp segments,
+         * the kernel segments them by vnet->gso_size
+         */
+        netif->mtu = 0xffff;
+        tunif->rxbuf_size = sizeof(struct virtio_net_hdr) + 0xffff;
+        NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL &
+                                       ~(NETIF_CHECKSUM_GEN_UDP | NETIF_CHECKSUM_GEN_TCP |
+                                         NETIF_CHECKSUM_CHECK_UDP | NETIF_CHECKSUM_CHECK_TCP));
+    }
+#endif
+    if (tunif_conf != NULL) {
+        tunif_conf->offload = tunif->vnet_hdr;
+    }
+    tunif->rxbuf_free = NULL;
+    tunif->rxbuf_free_count = 0;
+    tunif->rxbuf_free_max = LWIP_MAX(16, RXBUF_FREE_BYTES / tunif->rxbuf_size);
+
     return ERR_OK;
 }
 /*-----------------------------------------------------------------------------------*/
+/*
+ * tunif_open_queue():
+ *
+ * Attach one more queue to a multi-queue tun device, the kernel spreads
+ * flows over the queues by hash. Return the new queue fd.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+int
+tunif_open_queue(struct netif *netif) {
+    struct tunif *tunif = (struct tunif *) netif->state;
+    char tun_name[16];
+    int fd;
+
+    if (tunif->queues < 2) {
+        return -1;
+    }
+
+    memcpy(tun_name, tunif->name, sizeof(tun_name));
+    fd = tun_create(tun_name, 1, tunif->vnet_hdr);
+    if (fd >= 0) {
+        setnonblocking(fd);
+    }
+    return fd;
+}
+
+void
+tunif_use_queue(struct netif *netif, int fd) {
+    struct tunif *tunif = (struct tunif *) netif->state;
+
+    tunif->fd = fd;
+}
+/*-----------------------------------------------------------------------------------*/
+/*
+ * tunif_io_start():
+ *
+ * Set up the io_uring backend if requested, or just the batched writes with
+ * tx_batch_bytes, per process so it runs after the shards are forked. Return the fd the event loop watches before tunif_input,
+ * the ring's eventfd or the tun fd itself.
+ *
+ */
+/*-----------------------------------------------------------------------------------*/
+int
+tunif_io_start(struct netif *netif) {
+    struct tunif *tunif = (struct tunif *) netif->state;
+
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (tunif->uring_on) {
+        if (uring_start(tunif) == 0) {
+            return tunif->uring_rx ? tunif->ring.event_fd : tunif->fd;
+        }
+        printf("io_uring not available, fall back to epoll with unbatched writes\n");
+        tunif->uring_on = 0;
+        tunif->uring_rx = 0;
+    }
+#endif
+    return tunif->fd;
+}
+
+void
+tunif_flush(struct netif *netif) {
+#if defined(HAVE_LINUX_IO_URING_H)
+    struct tunif *tunif = (struct tunif *) netif->state;
+
+    if (tunif->uring_on) {
+        tunif_flush_ring(tunif);
+    }
+#else
+    LWIP_UNUSED_ARG(netif);
+#endif
+}
+/*-----------------------------------------------------------------------------------*/
 
 #endif /* LWIP_IPV4 */
@@ -11,10 +11,36 @@ extern "C" {
 #include "lwip/netif.h"
 #include "lwip/pbuf.h"
 
+/* largest tcp segment lwip may hand to tunif when offload is on */
+#define TUNIF_TSO_MSS (0xffff - 120)
+
+/* mss the receiver of a tcp flow negotiated, 0 if unknown, addresses in network order, ports in host order */
+typedef u16_t (*tunif_tcp_mss_fn)(u32_t src, u16_t sport, u32_t dst, u16_t dport);
+
+/* passed as the netif_add() state, tunif_init replaces it with its own state */
+struct tunif_conf {
+    int queues; // > 1 opens the device with IFF_MULTI_QUEUE
+    int offload; // IFF_VNET_HDR with tso/csum offload, cleared by tunif_init if unavailable
+    int uring; // io_uring for tun reads and writes, set up by tunif_io_start
+    int mtu; // link mtu, 0 for the 1500 default, up to 65535
+    int tx_batch_bytes; // queue output until tunif_flush or this many bytes, needs io_uring, 0 is off
+    tunif_tcp_mss_fn tcp_mss; // gso_size of tcp superpackets with offload, capped by the link mtu
+};
+
 err_t tunif_init(struct netif *netif);
 
+int tunif_open_queue(struct netif *netif);
+
+void tunif_use_queue(struct netif *netif, int fd);
+
+int tunif_io_start(struct netif *netif);
+
+/* submit queued output and io_uring reads, call once per event loop iteration */
+void tunif_flush(struct netif *netif);
+
 #if NO_SYS
-void tunif_input(struct netif *netif);
+/* read until EAGAIN or until max_packets / max_bytes is used up, return packets read */
+int tunif_input(struct netif *netif, int max_packets, int max_bytes);
 #endif /* NO_SYS */
 
 #ifdef __cplusplus
@@ -0,0 +1,173 @@
+#include "uring.h"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+    ring->event_fd = -1;
+
+    ring->fd = io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        goto err;
+    }
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+        ring->cq_ptr = NULL;
+        goto err;
+    }
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->sqe_submitted = ring->sqe_tail;
+
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+    /* completions wake the event loop through this */
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd < 0 ||
+        io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    uring_exit(ring);
+    return -1;
+}
+
+void uring_exit(struct uring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->event_fd >= 0) {
+        close(ring->event_fd);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+    ring->event_fd = -1;
+}
+
+int uring_register_files(struct uring *ring, const int *fds, unsigned nr) {
+    return io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, nr);
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned nr) {
+    return io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, nr);
+}
+
+/**
+ * next free sqe, zeroed, NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/**
+ * sqes prepared since the last uring_submit
+ */
+unsigned uring_sq_ready(struct uring *ring) {
+    return ring->sqe_tail - ring->sqe_submitted;
+}
+
+/**
+ * hand every prepared sqe to the kernel in one io_uring_enter
+ */
+int uring_submit(struct uring *ring) {
+    unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+    int ret;
+
+    if (to_submit == 0) {
+        return 0;
+    }
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    do {
+        ret = io_uring_enter(ring->fd, to_submit, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) {
+        ring->sqe_submitted += ret;
+    }
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,66 @@
+#ifndef LWIP_URING_H
+#define LWIP_URING_H
+
+#if defined(HAVE_LINUX_IO_URING_H)
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * minimal io_uring over the raw syscalls, completions are signalled on
+ * event_fd so the ring plugs into the libev loop as a plain ev_io
+ */
+struct uring {
+    int fd;
+    int event_fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail; // prepared, not yet published to the kernel
+    unsigned sqe_submitted; // published, not yet io_uring_enter()ed
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+
+void uring_exit(struct uring *ring);
+
+int uring_register_files(struct uring *ring, const int *fds, unsigned nr);
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned nr);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+unsigned uring_sq_ready(struct uring *ring);
+
+int uring_submit(struct uring *ring);
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif //LWIP_URING_H
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+
+#include "ringbuf.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/debug.h"
+
+/* keep at most this many idle bytes per ring size around */
+#define RINGBUF_POOL_BYTES (16 * 1024 * 1024)
+
+struct ringbuf_block {
+    struct ringbuf_block *next;
+};
+
+/* idle storage by log2 of the ring size */
+static struct ringbuf_block *pool[32];
+static u32_t pool_idle[32];
+
+static char *
+ringbuf_block_get(u32_t size) {
+    int order = __builtin_ctz(size);
+    struct ringbuf_block *b = pool[order];
+
+    if (b != NULL) {
+        pool[order] = b->next;
+        pool_idle[order] -= size;
+        return (char *) b;
+    }
+    return (char *) malloc(size);
+}
+
+static void
+ringbuf_block_put(char *data, u32_t size) {
+    int order = __builtin_ctz(size);
+    struct ringbuf_block *b = (struct ringbuf_block *) data;
+
+    if (pool_idle[order] + size > RINGBUF_POOL_BYTES) {
+        free(data);
+        return;
+    }
+    b->next = pool[order];
+    pool[order] = b;
+    pool_idle[order] += size;
+}
+
+void
+ringbuf_init(ringbuf_t *rb, u32_t size) {
+    LWIP_ASSERT("ring size is a power of two", size >= sizeof(struct ringbuf_block) && (size & (size - 1)) == 0);
+    rb->data = NULL;
+    rb->size = size;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+void
+ringbuf_release(ringbuf_t *rb) {
+    if (rb->data != NULL) {
+        ringbuf_block_put(rb->data, rb->size);
+        rb->data = NULL;
+    }
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+int
+ringbuf_readable(const ringbuf_t *rb, u32_t off, struct iovec *iov) {
+    u32_t used = ringbuf_used(rb) - off;
+    u32_t pos = (rb->head + off) & (rb->size - 1);
+    u32_t first = LWIP_MIN(used, rb->size - pos);
+
+    if (off >= ringbuf_used(rb)) {
+        return 0;
+    }
+    iov[0].iov_base = rb->data + pos;
+    iov[0].iov_len = first;
+    if (first == used) {
+        return 1;
+    }
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len = used - first;
+    return 2;
+}
+
+int
+ringbuf_writable(ringbuf_t *rb, struct iovec *iov) {
+    u32_t space = ringbuf_space(rb);
+    u32_t off = rb->tail & (rb->size - 1);
+    u32_t first = LWIP_MIN(space, rb->size - off);
+
+    if (space == 0) {
+        return 0;
+    }
+    if (rb->data == NULL) {
+        rb->data = ringbuf_block_get(rb->size);
+        if (rb->data == NULL) {
+            return 0;
+        }
+    }
+    iov[0].iov_base = rb->data + off;
+    iov[0].iov_len = first;
+    if (first == space) {
+        return 1;
+    }
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len = space - first;
+    return 2;
+}
+
+void
+ringbuf_produce(ringbuf_t *rb, u32_t len) {
+    LWIP_ASSERT("ring overflow", len <= ringbuf_space(rb));
+    rb->tail += len;
+}
+
+void
+ringbuf_consume(ringbuf_t *rb, u32_t len) {
+    LWIP_ASSERT("ring underflow", len <= ringbuf_used(rb));
+    rb->head += len;
+    if (rb->head == rb->tail) {
+        /* empty, hand the storage back and restart at offset 0 */
+        ringbuf_release(rb);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef IP2SOCKS_RINGBUF_H
+#define IP2SOCKS_RINGBUF_H
+
+#include <sys/uio.h>
+
+#include "lwip/arch.h"
+
+/**
+ * byte ring with a power of two capacity, head and tail run free and are masked
+ * on access. Storage comes from a pool on first write and goes back once the
+ * ring is empty, so idle connections hold none.
+ */
+typedef struct ringbuf {
+    char *data;
+    u32_t size;
+    u32_t head; // read position
+    u32_t tail; // write position
+} ringbuf_t;
+
+void ringbuf_init(ringbuf_t *rb, u32_t size);
+
+void ringbuf_release(ringbuf_t *rb);
+
+static inline u32_t ringbuf_used(const ringbuf_t *rb) {
+    return rb->tail - rb->head;
+}
+
+static inline u32_t ringbuf_space(const ringbuf_t *rb) {
+    return rb->size - (rb->tail - rb->head);
+}
+
+/* up to two segments of the readable bytes past off, for writev/sendmsg, return the count */
+int ringbuf_readable(const ringbuf_t *rb, u32_t off, struct iovec *iov);
+
+/* up to two segments of free space, for readv/recvmsg, 0 if full or out of memory */
+int ringbuf_writable(ringbuf_t *rb, struct iovec *iov);
+
+void ringbuf_produce(ringbuf_t *rb, u32_t len);
+
+void ringbuf_consume(ringbuf_t *rb, u32_t len);
+
+#endif //IP2SOCKS_RINGBUF_H
@@ -1,5 +1,75 @@
 #include <fcntl.h>
+#if defined(__linux__)
+// not netinet/tcp.h, its TCP_MSS clashes with lwipopts.h
+#include <linux/tcp.h>
+#endif
 #include "socks5.h"
+#include "socket_util.h"
+#include "ev.h"
+#include "stats.h"
+
+/* no authentication */
+static const char socks5_greeting[SOCKS5_GREETING_SIZE] = {SOCKS5_VERSION, 0x01, 0x00};
+
+static int socks5_pipeline = 0;
+
+/**
+ * send the greeting and the request together and read both replies afterwards,
+ * one round trip less for servers that accept the no-auth method
+ */
+void socks5_set_pipeline(int pipeline) {
+    socks5_pipeline = pipeline;
+}
+
+int socks5_get_pipeline(void) {
+    return socks5_pipeline;
+}
+
+static int socks5_fastopen = 0;
+
+/**
+ * connect with TCP_FASTOPEN_CONNECT, the first write goes out in the SYN once the kernel has a cookie
+ * and as a normal handshake otherwise
+ */
+void socks5_set_fastopen(int fastopen) {
+#if defined(TCP_FASTOPEN_CONNECT)
+    socks5_fastopen = fastopen;
+#else
+    if (fastopen) {
+        printf("socks_fastopen is not supported on this platform\n");
+    }
+#endif
+}
+
+static void socks5_fastopen_set(int sockfd) {
+#if defined(TCP_FASTOPEN_CONNECT)
+    int opt = 1;
+
+    if (socks5_fastopen && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt)) < 0) {
+        printf("TCP_FASTOPEN_CONNECT failed, errno %d, socks fastopen off\n", errno);
+        socks5_fastopen = 0;
+    }
+#endif
+}
+
+/**
+ * once the server answered, count whether the SYN carried our data
+ */
+static void socks5_fastopen_done(int sockfd) {
+#if defined(TCP_FASTOPEN_CONNECT)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (!socks5_fastopen) {
+        return;
+    }
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA)) {
+        stats.socks_tfo_syn_data++;
+    } else {
+        stats.socks_tfo_fallback++;
+    }
+#endif
+}
 
 int32_t socks5_sockset(int sockfd) {
     struct timeval tmo = {0};
@@ -39,6 +109,7 @@ int socks5_connect(const char *proxy_host, const char *proxy_port) {
     }
     // setnonblocking(socks_fd);
     socks5_sockset(socks_fd);
+    socks5_fastopen_set(socks_fd);
     if (0 > connect(socks_fd, (struct sockaddr *) &socks_proxy_addr, sizeof(socks_proxy_addr))) {
         printf("connect failed\n");
         return -1;
@@ -47,16 +118,72 @@ int socks5_connect(const char *proxy_host, const char *proxy_port) {
     return socks_fd;
 }
 
-int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype) {
-    char buff[BUFFER_SIZE];
-    /**
-     * socks 5 method request start
-     */
-    ((socks5_method_req_t *) buff)->ver = SOCKS5_VERSION;
-    ((socks5_method_req_t *) buff)->nmethods = 0x01;
-    ((socks5_method_req_t *) buff)->methods[0] = 0x00;
+int socks5_connect_nonblock(const char *proxy_host, const char *proxy_port) {
+    int socks_fd = 0;
+    struct sockaddr_in socks_proxy_addr;
+
+    socks_proxy_addr.sin_family = AF_INET;
+    socks_proxy_addr.sin_addr.s_addr = inet_addr(proxy_host);
+    socks_proxy_addr.sin_port = htons(atoi(proxy_port));
 
-    send(sockfd, buff, 3, 0);
+    if ((socks_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        printf("socket failed\n");
+        return -1;
+    }
+    socks5_sockset(socks_fd);
+    socks5_fastopen_set(socks_fd);
+    setnonblocking(socks_fd);
+    if (0 > connect(socks_fd, (struct sockaddr *) &socks_proxy_addr, sizeof(socks_proxy_addr)) &&
+        errno != EINPROGRESS) {
+        printf("connect failed\n");
+        close(socks_fd);
+        return -1;
+    }
+
+    return socks_fd;
+}
+
+size_t socks5_build_request(char *buf, const char *server_host, const char *server_port, u_char cmd, int atype) {
+    size_t idx = 0;
+    int p = atoi(server_port);
+
+    buf[idx++] = SOCKS5_VERSION;
+    buf[idx++] = cmd;
+    buf[idx++] = 0x00; /* RSV */
+
+    if (atype == 1) {
+        struct in_addr addr;
+
+        buf[idx++] = SOSKC5_ADDRTYPE_IPV4;
+        inet_aton(server_host, &addr);
+        memcpy(buf + idx, &addr.s_addr, 4);
+        idx += 4;
+    } else if (atype == 3) {
+        size_t host_len = strlen(server_host);
+        if (host_len > 255) {
+            host_len = 255;
+        }
+
+        buf[idx++] = SOSKC5_ADDRTYPE_DOMAIN;
+        buf[idx++] = (char) host_len;
+        memcpy(buf + idx, server_host, host_len);
+        idx += host_len;
+    } else {
+        // ipv6 TODO
+        return 0;
+    }
+
+    buf[idx++] = (char) ((p >> 8) & 0xff); /* PORT MSB */
+    buf[idx++] = (char) (p & 0xff);        /* PORT LSB */
+
+    return idx;
+}
+
+/**
+ * blocking method negotiation, no authentication
+ */
+static int socks5_method_reply(int sockfd) {
+    char buff[2];
 
     // VERSION and METHODS
     if (-1 == recv(sockfd, buff, 2, 0)) {
@@ -67,67 +194,22 @@ int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_
         printf("socks5_method_res_t error\n");
         return -1;
     }
-    /**
-     * socks 5 method request end
-     */
+    socks5_fastopen_done(sockfd);
 
-    /**
-     * socks 5 request start
-     */
-    if (atype == 1) {
-        unsigned char socksreq[600];
-        int idx;
-
-        idx = 0;
-        socksreq[idx++] = 5; /* version */
-        socksreq[idx++] = cmd;
-        socksreq[idx++] = 0;
-        socksreq[idx++] = 1; /* ATYP: IPv4 = 1 */
-
-        struct sockaddr_in *saddr_in = (struct sockaddr_in *) malloc(sizeof(struct sockaddr_in));;
-        saddr_in->sin_family = AF_INET;
-        inet_aton(server_host, &(saddr_in->sin_addr));
-        for (int i = 0; i < 4; i++) {
-            socksreq[idx++] = ((unsigned char *) &saddr_in->sin_addr.s_addr)[i];
-        }
+    return 0;
+}
 
-        int p = atoi(server_port);
-        socksreq[idx++] = (unsigned char) ((p >> 8) & 0xff); /* PORT MSB */
-        socksreq[idx++] = (unsigned char) (p & 0xff);        /* PORT LSB */
+/**
+ * blocking method negotiation, no authentication
+ */
+int socks5_method(int sockfd) {
+    send(sockfd, socks5_greeting, sizeof(socks5_greeting), 0);
 
-        send(sockfd, (char *) socksreq, idx, 0);
-        free(saddr_in);
-    } else if (atype == 3) {
-        char *buffer, *temp;
-        u_char v = 0x05, rsv = 0x00, atyp = 0x03;
-
-        const char host_len = (char) strlen(server_host);
-        uint16_t port = htons(atoi(server_port));
-        buffer = static_cast<char *>(malloc(strlen(server_host) + 7));
-        temp = buffer;
-        /* Assemble the request packet */
-        (void) memcpy(temp, &v, sizeof(v));
-        temp += sizeof(v);
-        (void) memcpy(temp, &cmd, sizeof(cmd));
-        temp += sizeof(cmd);
-        (void) memcpy(temp, &rsv, sizeof(rsv));
-        temp += sizeof(rsv);
-        (void) memcpy(temp, &atyp, sizeof(atyp));
-        temp += sizeof(atyp);
-        (void) memcpy(temp, &host_len, sizeof(host_len));
-        temp += sizeof(host_len);
-        (void) memcpy(temp, server_host, strlen(server_host));
-        temp += strlen(server_host);
-        (void) memcpy(temp, &port, sizeof(&port));
-        temp += sizeof(&port);
-        send(sockfd, buffer, temp - buffer, 0);
-        free(buffer);
-    } else if (atype == 4) {
-        // ipv6 TODO
-    }
-    /**
-     * socks 5 request end
-     */
+    return socks5_method_reply(sockfd);
+}
+
+static int socks5_request_reply(int sockfd) {
+    char buff[10];
 
     /**
      * socks 5 response
@@ -144,3 +226,317 @@ int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_
 
     return 0;
 }
+
+/**
+ * blocking request on a negotiated connection
+ */
+int socks5_request(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype) {
+    return socks5_request_pipelined(sockfd, 0, server_host, server_port, cmd, atype, NULL, 0);
+}
+
+/**
+ * blocking request with the greeting in front of it if the method is not negotiated yet,
+ * and the first payload bytes behind it, all in one write
+ */
+int socks5_request_pipelined(int sockfd, int greeting, const char *server_host, const char *server_port, u_char cmd,
+                             int atype, const char *payload, size_t payload_len) {
+    char buff[SOCKS5_REPLY_MAX_SIZE];
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    size_t idx = socks5_build_request(buff, server_host, server_port, cmd, atype);
+    if (idx == 0) {
+        return -1;
+    }
+
+    if (greeting) {
+        iov[iovcnt].iov_base = (void *) socks5_greeting;
+        iov[iovcnt].iov_len = sizeof(socks5_greeting);
+        iovcnt++;
+    }
+    iov[iovcnt].iov_base = buff;
+    iov[iovcnt].iov_len = idx;
+    iovcnt++;
+    if (payload_len > 0) {
+        iov[iovcnt].iov_base = (void *) payload;
+        iov[iovcnt].iov_len = payload_len;
+        iovcnt++;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    ssize_t n;
+    do {
+        n = writev(sockfd, iov, iovcnt);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 || (size_t) n != total) {
+        printf("socks5 request write failed, %zd of %zu bytes\n", n, total);
+        return -1;
+    }
+
+    if (greeting && socks5_method_reply(sockfd) < 0) {
+        return -1;
+    }
+    return socks5_request_reply(sockfd);
+}
+
+int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype) {
+    if (socks5_method(sockfd) < 0) {
+        return -1;
+    }
+    return socks5_request(sockfd, server_host, server_port, cmd, atype);
+}
+
+/**
+ * full length of a socks 5 reply, 0 if not enough bytes yet to tell
+ */
+static size_t socks5_reply_len(const char *res, size_t len) {
+    if (len < 5) {
+        return 0;
+    }
+    switch (((socks5_response_t *) res)->addrtype) {
+        case SOSKC5_ADDRTYPE_IPV4:
+            return 4 + 4 + 2;
+        case SOSKC5_ADDRTYPE_DOMAIN:
+            return 4 + 1 + (u_char) res[4] + 2;
+        case SOSKC5_ADDRTYPE_IPV6:
+            return 4 + 16 + 2;
+        default:
+            return SOCKS5_REPLY_MAX_SIZE + 1;
+    }
+}
+
+void socks5_handshake_init(socks5_handshake_t *hs, const char *server_host, const char *server_port, u_char cmd,
+                           int atype) {
+    size_t off = 0;
+
+    memset(hs, 0, sizeof(socks5_handshake_t));
+    hs->stage = SOCKS5_STAGE_CONNECTING;
+    hs->rep = 0xff;
+
+    if (socks5_pipeline) {
+        memcpy(hs->req, socks5_greeting, sizeof(socks5_greeting));
+        off = sizeof(socks5_greeting);
+        hs->pipelined = 1;
+    }
+
+    // the request is sent after the method reply unless pipelined, keep it until then
+    hs->req_len = socks5_build_request(hs->req + off, server_host, server_port, cmd, atype);
+    if (hs->req_len == 0) {
+        hs->stage = SOCKS5_STAGE_FAILED;
+    } else {
+        hs->req_len += off;
+    }
+}
+
+/**
+ * connect and negotiate the method only, the request is added once the connection is used
+ */
+void socks5_handshake_init_method(socks5_handshake_t *hs) {
+    memset(hs, 0, sizeof(socks5_handshake_t));
+    hs->stage = SOCKS5_STAGE_CONNECTING;
+    hs->rep = 0xff;
+}
+
+/**
+ * handshake on a connection that already went through the method negotiation
+ */
+void socks5_handshake_init_negotiated(socks5_handshake_t *hs, const char *server_host, const char *server_port,
+                                      u_char cmd, int atype) {
+    memset(hs, 0, sizeof(socks5_handshake_t));
+    hs->stage = SOCKS5_STAGE_REQUEST;
+    hs->rep = 0xff;
+
+    hs->req_len = socks5_build_request(hs->req, server_host, server_port, cmd, atype);
+    if (hs->req_len == 0) {
+        hs->stage = SOCKS5_STAGE_FAILED;
+    }
+}
+
+/**
+ * send the rest of req, with the client payload behind it in the same write
+ */
+static ssize_t socks5_send_req(int sockfd, socks5_handshake_t *hs, const struct iovec *payload, int iovcnt,
+                               size_t *payload_sent) {
+    struct iovec iov[1 + SOCKS5_PAYLOAD_IOV_MAX];
+    struct msghdr msg;
+    size_t left = hs->req_len - hs->req_sent;
+    int n = 0;
+    ssize_t ret;
+
+    iov[n].iov_base = hs->req + hs->req_sent;
+    iov[n].iov_len = left;
+    n++;
+    for (int i = 0; payload != NULL && i < iovcnt && i < SOCKS5_PAYLOAD_IOV_MAX; i++) {
+        iov[n++] = payload[i];
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    do {
+        ret = sendmsg(sockfd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return ret;
+    }
+    if ((size_t) ret > left) {
+        hs->req_sent = hs->req_len;
+        hs->payload_sent = 1;
+        if (payload_sent != NULL) {
+            *payload_sent += ret - left;
+        }
+    } else {
+        hs->req_sent += ret;
+    }
+    return ret;
+}
+
+int socks5_handshake_step(int sockfd, socks5_handshake_t *hs) {
+    return socks5_handshake_step_payload(sockfd, hs, NULL, 0, NULL);
+}
+
+/**
+ * drive the handshake as far as the socket allows, payload goes out with the last request bytes
+ * and payload_sent is increased by what the socket took of it
+ * return 1 if established, 0 if it needs more io, -1 on failure
+ */
+int socks5_handshake_step_payload(int sockfd, socks5_handshake_t *hs, const struct iovec *payload, int iovcnt,
+                                  size_t *payload_sent) {
+    ssize_t n;
+
+    for (;;) {
+        switch (hs->stage) {
+            case SOCKS5_STAGE_CONNECTING: {
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+                    printf("socks5 connect failed [%d]\n", err);
+                    hs->stage = SOCKS5_STAGE_FAILED;
+                    return -1;
+                }
+                if (hs->pipelined) {
+                    // greeting and request go out in the method stage
+                    hs->stage = SOCKS5_STAGE_METHOD;
+                    hs->res_len = 0;
+                    break;
+                }
+                // 3 bytes always fit in a fresh socket buffer
+                if (send(sockfd, socks5_greeting, sizeof(socks5_greeting), 0) != sizeof(socks5_greeting)) {
+                    // EINPROGRESS: fastopen without a cookie, the SYN went out without data
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN || errno == EINPROGRESS) {
+                        return 0;
+                    }
+                    hs->stage = SOCKS5_STAGE_FAILED;
+                    return -1;
+                }
+                hs->stage = SOCKS5_STAGE_METHOD;
+                hs->res_len = 0;
+                break;
+            }
+            case SOCKS5_STAGE_METHOD:
+                if (hs->pipelined && hs->req_sent < hs->req_len) {
+                    n = socks5_send_req(sockfd, hs, payload, iovcnt, payload_sent);
+                    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN || errno == EINPROGRESS)) {
+                        return 0;
+                    }
+                    if (n < 0) {
+                        hs->stage = SOCKS5_STAGE_FAILED;
+                        return -1;
+                    }
+                    break;
+                }
+                n = recv(sockfd, hs->res + hs->res_len, 2 - hs->res_len, 0);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return 0;
+                }
+                if (n <= 0) {
+                    printf("recv VERSION and METHODS error\n");
+                    hs->stage = SOCKS5_STAGE_FAILED;
+                    return -1;
+                }
+                hs->res_len += n;
+                if (hs->res_len < 2) {
+                    return 0;
+                }
+                if (SOCKS5_VERSION != ((socks5_method_res_t *) hs->res)->ver ||
+                    0x00 != ((socks5_method_res_t *) hs->res)->method) {
+                    printf("socks5_method_res_t error\n");
+                    hs->stage = SOCKS5_STAGE_FAILED;
+                    return -1;
+                }
+                socks5_fastopen_done(sockfd);
+                hs->res_len = 0;
+                if (hs->req_len == 0) {
+                    hs->stage = SOCKS5_STAGE_NEGOTIATED;
+                    return 1;
+                }
+                hs->stage = SOCKS5_STAGE_REQUEST;
+                break;
+            case SOCKS5_STAGE_REQUEST: {
+                if (hs->req_sent < hs->req_len) {
+                    n = socks5_send_req(sockfd, hs, payload, iovcnt, payload_sent);
+                    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        return 0;
+                    }
+                    if (n < 0) {
+                        hs->stage = SOCKS5_STAGE_FAILED;
+                        return -1;
+                    }
+                    break;
+                }
+
+                size_t want = socks5_reply_len(hs->res, hs->res_len);
+                if (want > SOCKS5_REPLY_MAX_SIZE) {
+                    printf("socks 5 response address type error\n");
+                    hs->stage = SOCKS5_STAGE_FAILED;
+                    return -1;
+                }
+                // read the fixed part first, then exactly the rest of the reply
+                n = recv(sockfd, hs->res + hs->res_len, (want == 0 ? 5 : want) - hs->res_len, 0);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return 0;
+                }
+                if (n <= 0) {
+                    printf("recv socks 5 response error\n");
+                    hs->stage = SOCKS5_STAGE_FAILED;
+                    return -1;
+                }
+                hs->res_len += n;
+                if (hs->res_len >= 2) {
+                    hs->rep = (u_char) hs->res[1];
+                }
+
+                want = socks5_reply_len(hs->res, hs->res_len);
+                if (want == 0 || hs->res_len < want) {
+                    break;
+                }
+                if (SOCKS5_VERSION != ((socks5_response_t *) hs->res)->ver || hs->rep != 0x00) {
+                    printf("socks 5 response error, rep is %d\n", hs->rep);
+                    hs->stage = SOCKS5_STAGE_FAILED;
+                    return -1;
+                }
+                hs->stage = SOCKS5_STAGE_ESTABLISHED;
+                return 1;
+            }
+            case SOCKS5_STAGE_NEGOTIATED:
+            case SOCKS5_STAGE_ESTABLISHED:
+                return 1;
+            default:
+                return -1;
+        }
+    }
+}
+
+/**
+ * ev events the handshake is waiting for
+ */
+int socks5_handshake_events(socks5_handshake_t *hs) {
+    if (hs->stage == SOCKS5_STAGE_CONNECTING ||
+        ((hs->stage == SOCKS5_STAGE_REQUEST || hs->pipelined) && hs->req_sent < hs->req_len)) {
+        return EV_WRITE;
+    }
+    return EV_READ;
+}
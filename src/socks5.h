@@ -10,6 +10,7 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 
 #include "var.h"
 
@@ -32,11 +33,75 @@ typedef struct {
 } socks5_request_t;
 typedef socks5_request_t socks5_response_t;
 
+/**
+ * non-blocking client handshake: connect -> method -> request -> established,
+ * a handshake without a request stops at negotiated (pooled connections)
+ */
+enum socks5_stages {
+    SOCKS5_STAGE_CONNECTING = 0,
+    SOCKS5_STAGE_METHOD,
+    SOCKS5_STAGE_NEGOTIATED,
+    SOCKS5_STAGE_REQUEST,
+    SOCKS5_STAGE_ESTABLISHED,
+    SOCKS5_STAGE_FAILED
+};
+
+// VER REP RSV ATYP + 255 bytes domain + length byte + PORT
+#define SOCKS5_REPLY_MAX_SIZE 262
+// no-auth greeting pipelined in front of the request
+#define SOCKS5_GREETING_SIZE 3
+// client payload iovecs sent along with the request
+#define SOCKS5_PAYLOAD_IOV_MAX 64
+
+typedef struct socks5_handshake {
+    u_char stage;
+    u_char rep; // REP field of the last reply, 0xff if none
+    u_char pipelined; // req starts with the greeting, sent without waiting for the method reply
+    u_char payload_sent; // client payload went out behind the request
+    char req[SOCKS5_GREETING_SIZE + SOCKS5_REPLY_MAX_SIZE];
+    size_t req_len;
+    size_t req_sent;
+    char res[SOCKS5_REPLY_MAX_SIZE];
+    size_t res_len;
+} socks5_handshake_t;
+
+void socks5_set_pipeline(int pipeline);
+
+int socks5_get_pipeline(void);
+
+void socks5_set_fastopen(int fastopen);
+
 int32_t socks5_sockset(int sockfd);
 
 int socks5_connect(const char *proxy_host, const char *proxy_port);
 
+int socks5_connect_nonblock(const char *proxy_host, const char *proxy_port);
+
+size_t socks5_build_request(char *buf, const char *server_host, const char *server_port, u_char cmd, int atype);
+
+int socks5_method(int sockfd);
+
+int socks5_request(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype);
+
+int socks5_request_pipelined(int sockfd, int greeting, const char *server_host, const char *server_port, u_char cmd,
+                             int atype, const char *payload, size_t payload_len);
+
 int socks5_auth(int sockfd, const char *server_host, const char *server_port, u_char cmd, int atype);
 
+void socks5_handshake_init(socks5_handshake_t *hs, const char *server_host, const char *server_port, u_char cmd,
+                           int atype);
+
+void socks5_handshake_init_method(socks5_handshake_t *hs);
+
+void socks5_handshake_init_negotiated(socks5_handshake_t *hs, const char *server_host, const char *server_port,
+                                      u_char cmd, int atype);
+
+int socks5_handshake_step(int sockfd, socks5_handshake_t *hs);
+
+int socks5_handshake_step_payload(int sockfd, socks5_handshake_t *hs, const struct iovec *payload, int iovcnt,
+                                  size_t *payload_sent);
+
+int socks5_handshake_events(socks5_handshake_t *hs);
+
 
 #endif //LWIP_SOCKS5_H
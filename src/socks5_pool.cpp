@@ -0,0 +1,174 @@
+#include "socks5_pool.h"
+#include "socket_util.h"
+#include "stats.h"
+#include "var.h"
+
+static const char *pool_host;
+static const char *pool_port;
+static int pool_size = 0;
+static ev_tstamp pool_max_idle = SOCKS5_POOL_MAX_IDLE;
+
+static struct socks5_pool_conn *pool_head = NULL;
+static int pool_count = 0; // connecting and ready
+static int pool_failed = 0; // last connect failed, wait for the next tick before retrying
+
+static ev_timer pool_tick;
+static ev_timer pool_refill;
+
+static void pool_conn_cb(struct ev_loop *loop, ev_io *watcher, int revents);
+
+static void pool_unlink(struct socks5_pool_conn *conn) {
+    struct socks5_pool_conn **pp;
+
+    for (pp = &pool_head; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == conn) {
+            *pp = conn->next;
+            break;
+        }
+    }
+    ev_io_stop(EV_DEFAULT, &conn->io);
+    pool_count--;
+}
+
+static void pool_drop(struct socks5_pool_conn *conn) {
+    pool_unlink(conn);
+    close(conn->io.fd);
+    free(conn);
+}
+
+static void pool_fill(void) {
+    while (!pool_failed && pool_count < pool_size) {
+        int fd = socks5_connect_nonblock(pool_host, pool_port);
+        if (fd < 0) {
+            pool_failed = 1;
+            break;
+        }
+
+        struct socks5_pool_conn *conn = (struct socks5_pool_conn *) malloc(sizeof(struct socks5_pool_conn));
+        if (conn == NULL) {
+            close(fd);
+            break;
+        }
+        memset(conn, 0, sizeof(struct socks5_pool_conn));
+        socks5_handshake_init_method(&conn->handshake);
+        conn->since = ev_now(EV_DEFAULT);
+
+        ev_io_init(&conn->io, pool_conn_cb, fd, socks5_handshake_events(&conn->handshake));
+        ev_io_start(EV_DEFAULT, &conn->io);
+
+        conn->next = pool_head;
+        pool_head = conn;
+        pool_count++;
+    }
+}
+
+static void pool_conn_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    struct socks5_pool_conn *conn = container_of(watcher, struct socks5_pool_conn, io);
+
+    if (conn->ready) {
+        /* nothing is expected on an idle connection, it is EOF or garbage */
+        pool_drop(conn);
+        return;
+    }
+
+    int ret = socks5_handshake_step(watcher->fd, &conn->handshake);
+    if (ret < 0) {
+        printf("socks5 pool negotiation failed\n");
+        pool_failed = 1;
+        pool_drop(conn);
+        return;
+    }
+
+    int events = ret == 0 ? socks5_handshake_events(&conn->handshake) : EV_READ;
+    if (ret == 1) {
+        conn->ready = 1;
+        conn->since = ev_now(loop);
+    }
+    if ((watcher->events & (EV_READ | EV_WRITE)) != events) {
+        ev_io_stop(loop, watcher);
+        ev_io_set(watcher, watcher->fd, events);
+        ev_io_start(loop, watcher);
+    }
+}
+
+/**
+ * drop connections idle for longer than max_idle, or stuck connecting as long, and top up
+ */
+static void pool_tick_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    struct socks5_pool_conn *conn = pool_head;
+    ev_tstamp now = ev_now(loop);
+
+    while (conn != NULL) {
+        struct socks5_pool_conn *next = conn->next;
+        if (now - conn->since > pool_max_idle) {
+            stats.socks_pool_expired++;
+            pool_drop(conn);
+        }
+        conn = next;
+    }
+
+    pool_failed = 0;
+    pool_fill();
+}
+
+static void pool_refill_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    pool_fill();
+}
+
+void socks5_pool_init(const char *proxy_host, const char *proxy_port, int size, int max_idle) {
+    pool_host = proxy_host;
+    pool_port = proxy_port;
+    pool_size = size;
+    if (max_idle > 0) {
+        pool_max_idle = max_idle;
+    }
+    if (pool_size <= 0) {
+        return;
+    }
+
+    ev_timer_init(&pool_tick, pool_tick_cb, pool_max_idle / 2, pool_max_idle / 2);
+    ev_timer_start(EV_DEFAULT, &pool_tick);
+    ev_timer_init(&pool_refill, pool_refill_cb, 0., 0.);
+
+    pool_fill();
+}
+
+/**
+ * take a negotiated non-blocking connection, -1 if none is ready.
+ * the pool is topped up from the loop rather than on the caller's path
+ */
+int socks5_pool_get(void) {
+    struct socks5_pool_conn *conn = pool_head;
+    ev_tstamp now = ev_now(EV_DEFAULT);
+    int fd = -1;
+
+    if (pool_size <= 0) {
+        return -1;
+    }
+
+    while (conn != NULL) {
+        struct socks5_pool_conn *next = conn->next;
+        if (conn->ready) {
+            if (now - conn->since > pool_max_idle) {
+                stats.socks_pool_expired++;
+                pool_drop(conn);
+            } else {
+                fd = conn->io.fd;
+                pool_unlink(conn);
+                free(conn);
+                break;
+            }
+        }
+        conn = next;
+    }
+
+    if (fd < 0) {
+        stats.socks_pool_misses++;
+    } else {
+        stats.socks_pool_hits++;
+    }
+    if (!ev_is_active(&pool_refill)) {
+        ev_timer_start(EV_DEFAULT, &pool_refill);
+    }
+    return fd;
+}
@@ -0,0 +1,27 @@
+#ifndef LWIP_SOCKS5_POOL_H
+#define LWIP_SOCKS5_POOL_H
+
+#include "ev.h"
+
+#include "socks5.h"
+
+/* seconds a negotiated connection may wait in the pool, servers drop idle clients */
+#define SOCKS5_POOL_MAX_IDLE 30
+
+/**
+ * connections to the socks server that already went through the method negotiation,
+ * refilled in the background so a new flow only sends its request
+ */
+typedef struct socks5_pool_conn {
+    ev_io io;
+    socks5_handshake_t handshake;
+    ev_tstamp since; // connect start, negotiation end once ready
+    int ready;
+    struct socks5_pool_conn *next;
+} socks5_pool_conn_t;
+
+void socks5_pool_init(const char *proxy_host, const char *proxy_port, int size, int max_idle);
+
+int socks5_pool_get(void);
+
+#endif //LWIP_SOCKS5_POOL_H
@@ -0,0 +1,56 @@
+#include <inttypes.h>
+
+#include "stats.h"
+
+struct stats stats;
+
+void stats_tun_rx(int packets, int bytes, int budget_hit) {
+    stats.tun_rx_wakeups++;
+    stats.tun_rx_packets += packets;
+    stats.tun_rx_bytes += bytes;
+    if (budget_hit) {
+        stats.tun_rx_budget_hits++;
+    }
+    if ((uint32_t) packets > stats.tun_rx_max_packets) {
+        stats.tun_rx_max_packets = (uint32_t) packets;
+    }
+}
+
+void stats_dump(FILE *fp) {
+    fprintf(fp, "lwip timer: runs %" PRIu64 ", late %" PRIu64 ", late avg %.2fms, late max %" PRIu32 "ms\n",
+            stats.lwip_timer_runs, stats.lwip_timer_late,
+            stats.lwip_timer_late ? (double) stats.lwip_timer_late_ms / stats.lwip_timer_late : 0.,
+            stats.lwip_timer_late_max_ms);
+    fprintf(fp, "tun rx: wakeups %" PRIu64 ", packets %" PRIu64 ", bytes %" PRIu64
+                ", packets/wakeup avg %.2f max %" PRIu32 ", budget hits %" PRIu64 "\n",
+            stats.tun_rx_wakeups, stats.tun_rx_packets, stats.tun_rx_bytes,
+            stats.tun_rx_wakeups ? (double) stats.tun_rx_packets / stats.tun_rx_wakeups : 0.,
+            stats.tun_rx_max_packets, stats.tun_rx_budget_hits);
+    fprintf(fp, "tun gso: rx %" PRIu64 ", tx %" PRIu64 "\n", stats.tun_rx_gso_packets, stats.tun_tx_gso_packets);
+    fprintf(fp, "tun tx: packets %" PRIu64 ", syscalls %" PRIu64 ", syscalls saved %" PRIu64 "\n",
+            stats.tun_tx_packets, stats.tun_tx_syscalls,
+            stats.tun_tx_packets > stats.tun_tx_syscalls ? stats.tun_tx_packets - stats.tun_tx_syscalls : 0);
+    fprintf(fp, "tun io_uring: submits %" PRIu64 ", sqes %" PRIu64 ", sqes/submit avg %.2f\n",
+            stats.tun_uring_submits, stats.tun_uring_sqes,
+            stats.tun_uring_submits ? (double) stats.tun_uring_sqes / stats.tun_uring_submits : 0.);
+    fprintf(fp, "socks pool: hits %" PRIu64 ", misses %" PRIu64 ", expired %" PRIu64 "\n",
+            stats.socks_pool_hits, stats.socks_pool_misses, stats.socks_pool_expired);
+    fprintf(fp, "socks handshake: payload pipelined %" PRIu64 ", tfo syn data %" PRIu64 ", tfo fallback %" PRIu64 "\n",
+            stats.socks_payload_pipelined, stats.socks_tfo_syn_data, stats.socks_tfo_fallback);
+    fprintf(fp, "tcp connect first: held %" PRIu64 ", connected %" PRIu64 ", rst %" PRIu64 ", icmp %" PRIu64 "\n",
+            stats.tcp_syn_held, stats.tcp_syn_connected, stats.tcp_syn_rst, stats.tcp_syn_icmp);
+    fprintf(fp, "fake ip: answers %" PRIu64 ", recycled %" PRIu64 " (%" PRIu64 " within ttl), unknown %" PRIu64 "\n",
+            stats.fake_ip_answers, stats.fake_ip_recycled, stats.fake_ip_recycled_live, stats.fake_ip_unknown);
+    fprintf(fp, "udp nat: opened %" PRIu64 ", reused %" PRIu64 ", expired %" PRIu64 ", evicted %" PRIu64
+                ", failed %" PRIu64 ", queue drops %" PRIu64 "\n",
+            stats.udp_nat_opened, stats.udp_nat_reused, stats.udp_nat_expired, stats.udp_nat_evicted,
+            stats.udp_nat_failed, stats.udp_nat_queue_drops);
+    fprintf(fp, "udp shared associates: opened %" PRIu64 ", dedicated %" PRIu64 ", unmatched %" PRIu64 "\n",
+            stats.udp_assoc_opened, stats.udp_assoc_dedicated, stats.udp_assoc_unmatched);
+    fprintf(fp, "udp relay: tx %" PRIu64 " datagrams in %" PRIu64 " syscalls, rx %" PRIu64 " datagrams in %" PRIu64
+                " syscalls\n",
+            stats.udp_tx_datagrams, stats.udp_tx_syscalls, stats.udp_rx_datagrams, stats.udp_rx_syscalls);
+    fprintf(fp, "udp offload: gso sends %" PRIu64 ", gro reads %" PRIu64 "\n",
+            stats.udp_tx_gso_sends, stats.udp_rx_gro_reads);
+    fflush(fp);
+}
@@ -0,0 +1,88 @@
+#ifndef IP2SOCKS_STATS_H
+#define IP2SOCKS_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * process wide counters, dump with `kill -USR1`
+ */
+struct stats {
+    /* lwip timers driven by the event loop */
+    uint64_t lwip_timer_runs;
+    uint64_t lwip_timer_late;     // runs later than the due time by >= 1ms
+    uint64_t lwip_timer_late_ms;  // sum of lateness
+    uint32_t lwip_timer_late_max_ms;
+
+    /* tun/tap reads */
+    uint64_t tun_rx_wakeups;
+    uint64_t tun_rx_packets;
+    uint64_t tun_rx_bytes;
+    uint64_t tun_rx_budget_hits; // wakeups that stopped on the budget, not on EAGAIN
+    uint32_t tun_rx_max_packets; // most packets read in one wakeup
+    uint64_t tun_rx_gso_packets; // tso superpackets from the kernel
+    uint64_t tun_tx_gso_packets; // tso superpackets to the kernel
+
+    /* tun writes, batching shows as fewer syscalls than packets */
+    uint64_t tun_tx_packets;
+    uint64_t tun_tx_syscalls; // writev() and io_uring_enter() calls that carried writes
+
+    /* io_uring tun backend */
+    uint64_t tun_uring_submits; // io_uring_enter calls
+    uint64_t tun_uring_sqes;    // reads and writes handed over by them
+
+    /* pre-negotiated socks connections */
+    uint64_t socks_pool_hits;
+    uint64_t socks_pool_misses;  // flows that connected and negotiated on their own
+    uint64_t socks_pool_expired; // dropped after max idle age
+    uint64_t socks_payload_pipelined; // flows whose first payload went out with the request
+    uint64_t socks_tfo_syn_data; // fastopen connects whose SYN data the server took
+    uint64_t socks_tfo_fallback; // fastopen connects that fell back to a normal handshake
+
+    /* tcp_connect_first */
+    uint64_t tcp_syn_held;
+    uint64_t tcp_syn_connected; // CONNECT succeeded, SYN passed on to lwip
+    uint64_t tcp_syn_rst;       // CONNECT failed, client reset
+    uint64_t tcp_syn_icmp;      // CONNECT failed as unreachable, client sent icmp
+
+    /* fake ip dns */
+    uint64_t fake_ip_answers;
+    uint64_t fake_ip_recycled;      // addresses taken from the least recently used domain
+    uint64_t fake_ip_recycled_live; // of those, still within the answer ttl
+    uint64_t fake_ip_unknown;       // flows to a fake address with no domain, e.g. after a restart
+
+    /* udp relay sessions */
+    uint64_t udp_nat_opened;  // udp associates
+    uint64_t udp_nat_reused;  // datagrams that went out on an existing session
+    uint64_t udp_nat_expired; // closed after the idle timeout
+    uint64_t udp_nat_evicted; // closed for a new flow with the table full
+    uint64_t udp_nat_failed;  // associates that failed or timed out
+    uint64_t udp_nat_queue_drops; // datagrams over the backlog of a flow still associating
+    uint64_t udp_assoc_opened;    // shared udp associates
+    uint64_t udp_assoc_dedicated; // sessions that needed one of their own, a domain or a busy destination
+    uint64_t udp_assoc_unmatched; // replies on a shared associate with no flow for their address
+
+    /* udp relay socket io, batching shows as fewer syscalls than datagrams */
+    uint64_t udp_tx_datagrams;
+    uint64_t udp_tx_syscalls;
+    uint64_t udp_rx_datagrams;
+    uint64_t udp_rx_syscalls;
+    uint64_t udp_tx_gso_sends; // sends that carried several datagrams with UDP_SEGMENT
+    uint64_t udp_rx_gro_reads; // reads that returned several datagrams coalesced by UDP_GRO
+};
+
+extern struct stats stats;
+
+void stats_tun_rx(int packets, int bytes, int budget_hit);
+
+void stats_dump(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //IP2SOCKS_STATS_H
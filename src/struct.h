@@ -20,6 +20,25 @@ struct Conf {
     char *netmask;
     char *after_start_shell;
     char *before_shutdown_shell;
+    char *tuntap_read_budget;
+    char *tuntap_read_budget_bytes;
+    char *tun_queues;
+    char *tun_offload;
+    char *io_backend;
+    char *mtu;
+    char *tun_tx_batch_bytes;
+    char *tcp_nocopy;
+    char *socks_pool_size;
+    char *socks_pool_max_idle;
+    char *socks_pipeline;
+    char *socks_fastopen;
+    char *fake_ip_range;
+    char *fake_ip_ttl;
+    char *tcp_connect_first;
+    char *udp_nat_max;
+    char *udp_nat_timeout;
+    char *udp_associations;
+    char *udp_offload;
     std::vector<std::vector<std::string> > domains;
 };
 
@@ -4,17 +4,28 @@
 #include <iostream>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <unordered_map>
 
 #include "socks5.h"
+#include "socks5_pool.h"
+#include "netif/socket_util.h"
 #include "struct.h"
 #include "var.h"
 #include "tcp_raw.h"
+#include "stats.h"
+#include "fake_ip.h"
 
 #include "lwip/opt.h"
 #include "lwip/stats.h"
 #include "lwip/tcp.h"
+#include "lwip/ip4.h"
+#include "lwip/icmp.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/tcp.h"
 
 #if LWIP_TCP && LWIP_CALLBACK_API
 
@@ -24,33 +35,218 @@ static ev_timer timeout_watcher;
 
 static ev_tstamp timeout = 60.;
 
-static void tcp_raw_send(struct tcp_pcb *tpcb, struct tcp_raw_state *es);
+/* > 0 when the netif segments tcp itself (tun offload), lwip then builds segments this large */
+static u16_t tso_mss = 0;
+
+/**
+ * a flow as it leaves lwip, addresses in network order, ports in host order
+ */
+struct tcp_raw_flow_key {
+    u32_t src;
+    u32_t dst;
+    u16_t sport;
+    u16_t dport;
+
+    bool operator==(const tcp_raw_flow_key &other) const {
+        return src == other.src && dst == other.dst && sport == other.sport && dport == other.dport;
+    }
+};
+
+struct tcp_raw_flow_key_hash {
+    size_t operator()(const tcp_raw_flow_key &key) const {
+        uint64_t addrs = (uint64_t) key.src << 32 | key.dst;
+        uint64_t ports = (uint64_t) key.sport << 16 | key.dport;
+        return std::hash<uint64_t>()(addrs ^ ports * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+/* mss the client negotiated, for flows whose pcb->mss was raised to tso_mss, until lwip frees the pcb */
+static std::unordered_map<tcp_raw_flow_key, u16_t, tcp_raw_flow_key_hash> peer_mss;
+static u8_t peer_mss_id;
+
+static u8_t linger_id;
+
+/* tcp_write references socks_buf instead of copying, the bytes are released once acked */
+static int tcp_nocopy = 0;
+
+/* SYNs wait in tcp_raw_ip4_input_hook until the socks CONNECT for them is answered */
+static int tcp_connect_first = 0;
+
+/**
+ * a held SYN and the socks connection opened for it
+ */
+typedef struct tcp_raw_syn {
+    ev_io io;
+    ev_timer timer; // CONNECT deadline, then how long accept may take once the SYN is back in lwip
+    socks5_handshake_t handshake;
+    struct pbuf *p; // the SYN, copied out of the netif buffer
+    struct netif *inp;
+    u32_t src; // client, network order
+    u32_t dst;
+    u16_t sport;
+    u16_t dport;
+    u32_t seqno;
+    int ready; // CONNECT succeeded and the SYN went on to lwip, tcp_raw_accept takes the socket
+    struct tcp_raw_syn *next;
+} tcp_raw_syn;
+
+static struct tcp_raw_syn *syn_list = NULL;
+
+/**
+ * socks_buf of a closed connection while lwip may still retransmit from it,
+ * freed once it is acked or with the pcb, whether that ends in a close, a RST or an abort
+ */
+struct tcp_raw_linger {
+    ringbuf_t rb;
+    u32_t inflight;
+};
+
+static err_t tcp_raw_send(struct tcp_pcb *tpcb, struct tcp_raw_state *es);
+
+static void send_data_lwip(struct tcp_pcb *pcb, struct tcp_raw_state *es);
+
+static err_t free_all(struct ev_loop *loop, ev_io *watcher, struct tcp_raw_state *es, struct tcp_pcb *pcb);
+
+/**
+ * drop len sent bytes from the front of buf, pbufs are freed one by one as they empty
+ */
+static void
+tcp_raw_consume(struct tcp_raw_state *es, u32_t len) {
+    while (es->buf != NULL) {
+        struct pbuf *q = es->buf;
+        u16_t left = (u16_t) (q->len - es->buf_off);
+
+        if (len < left) {
+            es->buf_off = (u16_t) (es->buf_off + len);
+            es->buf_len -= len;
+            break;
+        }
+        len -= left;
+        es->buf_len -= left;
+        es->buf = q->next;
+        es->buf_off = 0;
+        q->next = NULL;
+        pbuf_free(q);
+    }
+    if (es->buf == NULL) {
+        es->buf_tail = NULL;
+    }
+}
 
 
 static void
 tcp_raw_free(struct tcp_raw_state *es) {
     if (es != NULL) {
-        if (es->pcb != NULL) {
-            tcp_close(es->pcb);
-        }
+        tcp_raw_consume(es, es->buf_len);
+        ringbuf_release(&es->socks_buf);
         free(es);
     }
 }
 
+/* ext arg destroy callback, data is the flow key */
+static void
+tcp_raw_peer_mss_destroy(u8_t id, void *data) {
+    struct tcp_raw_flow_key *key = (struct tcp_raw_flow_key *) data;
+
+    LWIP_UNUSED_ARG(id);
+    peer_mss.erase(*key);
+    free(key);
+}
+
+static const struct tcp_ext_arg_callbacks peer_mss_callbacks = {tcp_raw_peer_mss_destroy, NULL};
+
+/**
+ * lwip sends segments of up to tso_mss on pcb, the netif segments them at the mss
+ * the client negotiated
+ */
+static void
+tcp_raw_raise_mss(struct tcp_pcb *pcb) {
+    struct tcp_raw_flow_key *key = (struct tcp_raw_flow_key *) malloc(sizeof(struct tcp_raw_flow_key));
+
+    if (key == NULL) {
+        return;
+    }
+    key->src = ip_addr_get_ip4_u32(&pcb->local_ip);
+    key->dst = ip_addr_get_ip4_u32(&pcb->remote_ip);
+    key->sport = pcb->local_port;
+    key->dport = pcb->remote_port;
+    peer_mss[*key] = pcb->mss;
+    tcp_ext_arg_set_callbacks(pcb, peer_mss_id, &peer_mss_callbacks);
+    tcp_ext_arg_set(pcb, peer_mss_id, key);
+    pcb->mss = tso_mss;
+}
+
+/* ext arg destroy callback, lwip frees the pcb and its segments */
 static void
+tcp_raw_linger_free(u8_t id, void *data) {
+    struct tcp_raw_linger *lg = (struct tcp_raw_linger *) data;
+
+    LWIP_UNUSED_ARG(id);
+    ringbuf_release(&lg->rb);
+    free(lg);
+}
+
+static const struct tcp_ext_arg_callbacks linger_callbacks = {tcp_raw_linger_free, NULL};
+
+static err_t
+tcp_raw_linger_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+    struct tcp_raw_linger *lg = (struct tcp_raw_linger *) arg;
+    u32_t acked = LWIP_MIN(len, lg->inflight);
+
+    lg->inflight -= acked;
+    if (lg->inflight == 0) {
+        tcp_arg(tpcb, NULL);
+        tcp_sent(tpcb, NULL);
+        tcp_ext_arg_set_callbacks(tpcb, linger_id, NULL);
+        tcp_ext_arg_set(tpcb, linger_id, NULL);
+        tcp_raw_linger_free(linger_id, lg);
+    }
+    return ERR_OK;
+}
+
+/**
+ * close tpcb and free es, ERR_ABRT if tpcb had to be aborted. An lwip callback must then
+ * return ERR_ABRT itself, the pcb is gone
+ */
+static err_t
 tcp_raw_close(struct tcp_pcb *tpcb, struct tcp_raw_state *es) {
+    err_t ret = ERR_OK;
+
     if (tpcb != NULL) {
         tcp_arg(tpcb, NULL);
         tcp_sent(tpcb, NULL);
         tcp_recv(tpcb, NULL);
         tcp_err(tpcb, NULL);
         tcp_poll(tpcb, NULL, 0);
-        tcp_close(tpcb);
+        /*
+         * unacked segments may still point into socks_buf, hand it to the pcb. If
+         * tcp_close resets instead (client data not taken yet), the pcb and the
+         * linger go right away
+         */
+        if (es != NULL && es->socks_buf_inflight > 0) {
+            struct tcp_raw_linger *lg = (struct tcp_raw_linger *) malloc(sizeof(struct tcp_raw_linger));
+            if (lg != NULL) {
+                lg->rb = es->socks_buf;
+                lg->inflight = es->socks_buf_inflight;
+                tcp_arg(tpcb, lg);
+                tcp_sent(tpcb, tcp_raw_linger_sent);
+                tcp_ext_arg_set_callbacks(tpcb, linger_id, &linger_callbacks);
+                tcp_ext_arg_set(tpcb, linger_id, lg);
+            } else {
+                printf("tcp_raw_close: out of memory, leak socks_buf rather than free it under lwip\n");
+            }
+            ringbuf_init(&es->socks_buf, es->socks_buf.size);
+        }
+        if (tcp_close(tpcb) != ERR_OK) {
+            /* no memory for the FIN, the pcb must not live on without callbacks */
+            tcp_abort(tpcb);
+            ret = ERR_ABRT;
+        }
     }
 
     if (es != NULL) {
-        es->socks_buf_used = 0;
-        es->buf_used = 0;
+        es->pcb = NULL;
+        ev_io_stop(EV_DEFAULT, &(es->write_io));
         if (es->socks_fd > 0) {
             if (&(es->io) != NULL) {
                 close(es->socks_fd);
@@ -59,39 +255,108 @@ tcp_raw_close(struct tcp_pcb *tpcb, struct tcp_raw_state *es) {
         }
 
 
-        if (es->block_ctx->watcher.active != 0) {
-            ev_timer_stop(EV_DEFAULT, &(es->block_ctx->watcher));
-        }
         if (es->timeout_ctx->watcher.active != 0) {
             ev_timer_stop(EV_DEFAULT, &(es->timeout_ctx->watcher));
         }
 
-        free(es->block_ctx);
         free(es->timeout_ctx);
 
         tcp_raw_free(es);
     }
+    return ret;
 }
 
+/* tcp_recved takes at most 64K at a time */
 static void
+tcp_raw_recved(struct tcp_pcb *tpcb, u32_t len) {
+    while (len > 0) {
+        u16_t n = (u16_t) LWIP_MIN(len, 0xffff);
+        tcp_recved(tpcb, n);
+        len -= n;
+    }
+}
+
+/**
+ * iovecs over the unsent part of buf
+ */
+static int
+tcp_raw_buf_iovec(struct tcp_raw_state *es, struct iovec *iov, int iovmax) {
+    struct pbuf *q;
+    u16_t off = es->buf_off;
+    int iovcnt = 0;
+
+    for (q = es->buf; q != NULL && iovcnt < iovmax; q = q->next) {
+        if (q->len > off) {
+            iov[iovcnt].iov_base = (char *) q->payload + off;
+            iov[iovcnt].iov_len = q->len - off;
+            iovcnt++;
+        }
+        off = 0;
+    }
+    return iovcnt;
+}
+
+/**
+ * write buf to the socks socket as far as it takes it. ERR_CLSD or ERR_ABRT, as from
+ * tcp_raw_close, if es was closed on error
+ */
+static err_t
 tcp_raw_send(struct tcp_pcb *tpcb, struct tcp_raw_state *es) {
-    if (es->buf_used > 0) {
-        // 缓冲区的数据全部发送
-        ssize_t ret = send(es->socks_fd, es->buf.c_str(), es->buf_used, 0);
+    if (es->handshake.stage != SOCKS5_STAGE_ESTABLISHED) {
+        // keep it in buf until the socks 5 tunnel is ready, lwip window bounds it
+        return ERR_OK;
+    }
+    if (es->buf_len > 0) {
+        // 缓冲区的数据全部发送, straight from the pbuf payloads
+        struct iovec iov[PBUF_IOV_MAX];
+        struct msghdr msg;
+        int iovcnt = tcp_raw_buf_iovec(es, iov, PBUF_IOV_MAX);
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t ret;
+        do {
+            ret = sendmsg(es->socks_fd, &msg, 0);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ret = 0;
+        } else if (ret < 0) {
+            printf("<-------------------------------------- send to socks failed %ld errno %d\n", ret, errno);
+            return tcp_raw_close(tpcb, es) == ERR_ABRT ? ERR_ABRT : ERR_CLSD;
+        }
 
         if (ret > 0) {
-            u16_t plen = es->buf_used;
-
-            es->buf.clear();
-            es->buf_used = 0;
+            tcp_raw_consume(es, (u32_t) ret);
 
-            /* we can read more data now */
-            tcp_recved(tpcb, plen);
-        } else {
-            printf("<-------------------------------------- send to socks failed %ld\n", ret);
-            tcp_raw_close(tpcb, es);
+            /* only what the kernel took opens the window again, upstream drain paces the client */
+            tcp_raw_recved(tpcb, (u32_t) ret);
         }
     }
+
+    /* the socket buffer is full, write_cb takes over until it drains */
+    if (es->buf_len > 0) {
+        ev_io_start(EV_DEFAULT, &(es->write_io));
+    } else {
+        ev_io_stop(EV_DEFAULT, &(es->write_io));
+    }
+    return ERR_OK;
+}
+
+static void
+write_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    struct tcp_raw_state *es = container_of(watcher, struct tcp_raw_state, write_io);
+
+    ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
+
+    if (tcp_raw_send(es->pcb, es) != ERR_OK) {
+        return;
+    }
+    if (es->buf_len == 0 && es->state == ES_CLOSING) {
+        /* the client is gone and everything it sent is upstream */
+        tcp_raw_close(es->pcb, es);
+    }
 }
 
 static void
@@ -104,31 +369,33 @@ tcp_raw_error(void *arg, err_t err) {
 
     if (es != NULL) {
         printf("tcp_raw_error is %d %s\n", err, lwip_strerr(err));
-        if (es->pcb != NULL) {
-            tcp_raw_close(es->pcb, es);
-        } else {
-            tcp_raw_free(es);
-        }
+        /* lwip has freed the pcb and its segments already */
+        es->pcb = NULL;
+        tcp_raw_close(NULL, es);
     }
 }
 
 static err_t
 tcp_raw_poll(void *arg, struct tcp_pcb *tpcb) {
-    err_t ret_err;
+    err_t ret_err = ERR_OK;
     struct tcp_raw_state *es;
 
     es = (struct tcp_raw_state *) arg;
     if (es != NULL) {
-        if (es->buf_used > 0) {
+        if (ringbuf_used(&es->socks_buf) > es->socks_buf_inflight) {
+            /* tcp_write ran out of segments earlier and nothing was acked since */
+            send_data_lwip(tpcb, es);
+        }
+        if (es->buf_len > 0) {
             /* there is a remaining pbuf (chain)  */
-            tcp_raw_send(tpcb, es);
+            ret_err = tcp_raw_send(tpcb, es);
         } else {
             /* no remaining pbuf (chain)  */
             if (es->state == ES_CLOSING) {
-                tcp_raw_close(tpcb, es);
+                ret_err = tcp_raw_close(tpcb, es);
             }
         }
-        ret_err = ERR_OK;
+        ret_err = ret_err == ERR_ABRT ? ERR_ABRT : ERR_OK;
     } else {
         /* nothing to be done */
         tcp_abort(tpcb);
@@ -141,21 +408,80 @@ static err_t
 tcp_raw_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
     struct tcp_raw_state *es;
 
-    LWIP_UNUSED_ARG(len);
-
     es = (struct tcp_raw_state *) arg;
     es->retries = 0;
 
-    if (es->buf_used > 0) {
+    if (es->socks_buf_inflight > 0) {
+        /* acked, lwip no longer references these bytes */
+        u32_t acked = LWIP_MIN(len, es->socks_buf_inflight);
+        es->socks_buf_inflight -= acked;
+        ringbuf_consume(&es->socks_buf, acked);
+    }
+    if (ringbuf_used(&es->socks_buf) > es->socks_buf_inflight) {
+        /* acked bytes freed the send buffer, move more of socks_buf into it */
+        ev_timer_again(EV_DEFAULT, &(es->timeout_ctx->watcher));
+        send_data_lwip(tpcb, es);
+    }
+    if (es->lwip_blocked && ringbuf_used(&es->socks_buf) <= es->socks_buf.size / 4) {
+        es->lwip_blocked = 0;
+        ev_io_start(EV_DEFAULT, &(es->io));
+    }
+    if (es->socks_eof && ringbuf_used(&es->socks_buf) == es->socks_buf_inflight) {
+        return free_all(EV_DEFAULT, &(es->io), es, tpcb);
+    }
+
+    err_t ret_err = ERR_OK;
+    if (es->buf_len > 0) {
         /* still got pbufs to send */
         tcp_sent(tpcb, tcp_raw_sent);
-        tcp_raw_send(tpcb, es);
+        ret_err = tcp_raw_send(tpcb, es);
     } else {
         /* no more pbufs to send */
         if (es->state == ES_CLOSING) {
-            tcp_raw_close(tpcb, es);
+            ret_err = tcp_raw_close(tpcb, es);
         }
     }
+    return ret_err == ERR_ABRT ? ERR_ABRT : ERR_OK;
+}
+
+/**
+ * keep p at the end of buf, it is freed as the socks socket takes its bytes. p may reference a
+ * whole tun rx buffer, a small one queued behind a slow upstream is copied to free that buffer
+ */
+static err_t
+tcp_raw_queue(struct tcp_raw_state *es, struct pbuf *p) {
+    if (es->buf_len > 0 && p->tot_len <= TCP_RAW_QUEUE_COPY_MAX) {
+        struct pbuf *q;
+
+        for (q = p; q != NULL && !(q->flags & PBUF_FLAG_IS_CUSTOM); q = q->next) {
+        }
+        if (q != NULL) {
+            q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+            /* out of memory keeps the reference */
+            if (q != NULL && pbuf_copy(q, p) == ERR_OK) {
+                pbuf_free(p);
+                p = q;
+            } else if (q != NULL) {
+                pbuf_free(q);
+            }
+        }
+    }
+
+    struct pbuf *last = p;
+
+    while (last->next != NULL) {
+        last = last->next;
+    }
+
+    /* linked by hand, pbuf_cat would overflow the u16 tot_len of a whole window */
+    if (es->buf_tail != NULL) {
+        es->buf_tail->next = p;
+    } else {
+        es->buf = p;
+        es->buf_off = 0;
+    }
+    es->buf_tail = last;
+    es->buf_len += p->tot_len;
     return ERR_OK;
 }
 
@@ -167,123 +493,104 @@ tcp_raw_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
     struct tcp_raw_state *es;
     err_t ret_err;
 
-    char buf[TCP_WND];
-
     LWIP_ASSERT("arg != NULL", arg != NULL);
     es = (struct tcp_raw_state *) arg;
     if (p == NULL) {
         /* remote host closed connection */
         es->state = ES_CLOSING;
-        if (es->buf_used <= 0) {
+        if (es->buf_len == 0) {
             /* we're done sending, close it */
-            tcp_raw_close(tpcb, es);
+            ret_err = tcp_raw_close(tpcb, es);
         } else {
             /* we're not done yet */
-            tcp_raw_send(tpcb, es);
+            ret_err = tcp_raw_send(tpcb, es);
         }
-        ret_err = ERR_OK;
     } else if (err != ERR_OK) {
-        /* cleanup, for unknown reason */
-        if (p != NULL) {
-            pbuf_free(p);
-        }
+        /* cleanup, for unknown reason, the dropped bytes still reopen the window */
+        tcp_recved(tpcb, p->tot_len);
+        pbuf_free(p);
         // send last data
-        tcp_raw_send(tpcb, es);
-        ret_err = err;
+        ret_err = tcp_raw_send(tpcb, es);
     } else if (es->state == ES_ACCEPTED) {
         /* first data chunk in p->payload */
-        es->state = ES_RECEIVED;
-
-        pbuf_copy_partial(p, buf, p->tot_len, 0);
-
-        std::string buf_cpp(buf, p->tot_len);
-        es->buf.append(buf_cpp);
-        es->buf_used += p->tot_len;
-
-        tcp_raw_send(tpcb, es);
-        ret_err = ERR_OK;
+        ret_err = tcp_raw_queue(es, p);
+        if (ret_err == ERR_OK) {
+            es->state = ES_RECEIVED;
+            ret_err = tcp_raw_send(tpcb, es);
+        }
     } else if (es->state == ES_RECEIVED) {
         /* read some more data */
-        pbuf_copy_partial(p, buf, p->tot_len, 0);
-
-        std::string buf_cpp(buf, p->tot_len);
-        es->buf.append(buf_cpp);
-        es->buf_used += p->tot_len;
-        tcp_raw_send(tpcb, es);
-
-        ret_err = ERR_OK;
+        ret_err = tcp_raw_queue(es, p);
+        if (ret_err == ERR_OK) {
+            ret_err = tcp_raw_send(tpcb, es);
+        }
     } else {
         /* unkown es->state, trash data  */
         tcp_recved(tpcb, p->tot_len);
         pbuf_free(p);
         // send last data
-        tcp_raw_send(tpcb, es);
-        ret_err = ERR_OK;
+        ret_err = tcp_raw_send(tpcb, es);
     }
-    return ret_err;
+    /* p is queued or freed whatever happened to es, an aborted pcb must be reported */
+    return ret_err == ERR_ABRT ? ERR_ABRT : ERR_OK;
 }
 
-static void free_all(struct ev_loop *loop, ev_io *watcher, struct tcp_raw_state *es, struct tcp_pcb *pcb) {
+static err_t free_all(struct ev_loop *loop, ev_io *watcher, struct tcp_raw_state *es, struct tcp_pcb *pcb) {
+    ev_io_stop(EV_DEFAULT, &(es->write_io));
     close(watcher->fd);
     ev_io_stop(EV_DEFAULT, watcher);
     es->socks_fd = 0;
-    tcp_raw_close(pcb, es);
+    return tcp_raw_close(pcb, es);
 }
 
 
 // https://github.com/dreamcat4/lwip/blob/master/contrib/apps/httpserver_raw/httpd.c
 static void send_data_lwip(struct tcp_pcb *pcb, struct tcp_raw_state *es) {
     if (pcb != NULL && es != NULL) {
-        err_t err;
+        err_t err = ERR_OK;
         u16_t len;
+        u32_t written = 0;
+        struct iovec iov[2];
+        int i, iovcnt;
 
         /* We cannot send more data than space available in the send buffer. */
         if (pcb->state != 0) {
-            if (tcp_sndbuf(pcb) < es->socks_buf_used) {
-                len = tcp_sndbuf(pcb);
-            } else {
-                len = es->socks_buf_used;
-            }
+            iovcnt = ringbuf_readable(&es->socks_buf, es->socks_buf_inflight, iov);
+
+            for (i = 0; i < iovcnt && err == ERR_OK; i++) {
+                /* the send buffer is window scaled, tcp_write takes at most 64K */
+                len = (u16_t) LWIP_MIN(LWIP_MIN(tcp_sndbuf(pcb), iov[i].iov_len), 0xffff);
+
+                // 发送缓冲区满
+                if (len == 0) {
+                    break;
+                }
 
-            // 发送缓冲区满
-            if (tcp_sndbuf(pcb) == 0) {
-                // FIXME
-                // return;
+                err = tcp_write(pcb, iov[i].iov_base, len, tcp_nocopy ? 0 : TCP_WRITE_FLAG_COPY);
+                if (err == ERR_MEM) {
+                    /* segment queue full, tcp_raw_sent or tcp_raw_poll carry on */
+                    break;
+                }
+                if (err != ERR_OK) {
+                    printf("send_data_lwip: error %s len %d %d\n", lwip_strerr(err), len, tcp_sndbuf(pcb));
+                    break;
+                }
+                written += len;
+                if (len < iov[i].iov_len) {
+                    break;
+                }
             }
 
-            if (len > 0) {
-                do {
-                    err = tcp_write(pcb, es->socks_buf.c_str(), len, TCP_WRITE_FLAG_COPY);
-
-                    if (err == ERR_MEM) {
-                        if ((tcp_sndbuf(pcb) == 0) || (tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN)) {
-                            /* no need to try smaller sizes */
-                            len = 1;
-                        } else {
-                            len /= 2;
-                        }
-                        printf("Send failed, trying less (%d bytes)\n", len);
-                    }
-                } while (err == ERR_MEM && len > 1);
-
-                if (err == ERR_OK) {
-                    if (es->socks_buf.size() == len) {
-                        es->socks_buf.clear();
-                    } else {
-                        es->socks_buf.erase(es->socks_buf.begin(), es->socks_buf.end() - (es->socks_buf.size() - len));
-                    }
-                    es->socks_buf_used -= len;
-
-                    err_t wr_err = tcp_output(pcb);
-                    if (wr_err != ERR_OK) {
-                        printf("<---------------------------------- tcp_output wr_wrr is %s\n", lwip_strerr(wr_err));
-                    } else {
-                        if (es->lwip_blocked) {
-                            es->lwip_blocked = 0;
-                        }
-                    }
+            if (written > 0) {
+                if (tcp_nocopy) {
+                    es->socks_buf_inflight += written;
                 } else {
-                    printf("send_data_lwip: error %s len %d %d\n", lwip_strerr(err), len, tcp_sndbuf(pcb));
+                    ringbuf_consume(&es->socks_buf, written);
+                }
+
+                err_t wr_err = tcp_output(pcb);
+                if (wr_err != ERR_OK) {
+                    printf("<---------------------------------- tcp_output wr_wrr is %s\n", lwip_strerr(wr_err));
                 }
             }
         }
@@ -303,16 +610,6 @@ timeout_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
     free_all(loop, &(es->io), es, es->pcb);
 }
 
-static void
-block_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
-    timer_ctx *block_ctx = container_of(watcher, timer_ctx, watcher);
-    struct tcp_raw_state *es = block_ctx->raw_state;
-    write_and_output(es->pcb, es);
-    es->lwip_blocked = 0;
-    printf("Reset lwip block\n");
-    ev_timer_stop(EV_DEFAULT, watcher);
-}
-
 
 static void read_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
     struct tcp_raw_state *es = container_of(watcher, struct tcp_raw_state, io);
@@ -320,16 +617,22 @@ static void read_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
 
     ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
 
-    if (es->socks_buf_used > BUFFER_SIZE) {
-        es->lwip_blocked = 1;
-        ev_timer_start(EV_DEFAULT, &(es->block_ctx->watcher));
+    struct iovec iov[2];
+    int iovcnt;
+    ssize_t nreads;
+
+    iovcnt = ringbuf_writable(&es->socks_buf, iov);
+    if (iovcnt == 0) {
+        printf("<---------------------------------- out of memory for socks_buf, force close!!!\n");
+        free_all(loop, watcher, es, pcb);
         return;
     }
 
-    char buffer[BUFFER_SIZE];
-    ssize_t nreads;
-
-    nreads = recv(watcher->fd, buffer, BUFFER_SIZE, 0);
+    /* straight into the ring, both free segments at once */
+    nreads = readv(watcher->fd, iov, iovcnt);
+    if (nreads < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
     if (nreads < 0) {
         printf("<---------------------------------- read error [%d] force close!!!\n", errno);
         free_all(loop, watcher, es, pcb);
@@ -339,20 +642,339 @@ static void read_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
     // EOF
     if (0 == nreads) {
         write_and_output(pcb, es);
+        if (ringbuf_used(&es->socks_buf) > es->socks_buf_inflight) {
+            /* tcp_raw_sent closes once the rest is in lwip */
+            es->socks_eof = 1;
+            ev_io_stop(loop, watcher);
+            return;
+        }
         free_all(loop, watcher, es, pcb);
         return;
     }
 
-    std::string buf_cpp(buffer, nreads);
-    es->socks_buf.append(buf_cpp);
-    es->socks_buf_used += nreads;
+    ringbuf_produce(&es->socks_buf, (u32_t) nreads);
 
-    if (es->socks_buf_used > nreads) {
-        std::cout << "recv " << nreads << " data, " << "es->socks_buf_used is " << es->socks_buf_used
-                  << ", (tcp_sndbuf(pcb) is " << tcp_sndbuf(pcb) << std::endl;
+    write_and_output(pcb, es);
+
+    if (ringbuf_space(&es->socks_buf) == 0) {
+        /* the client acks slower than upstream sends, tcp_raw_sent resumes */
+        es->lwip_blocked = 1;
+        ev_io_stop(loop, watcher);
     }
+}
 
-    write_and_output(pcb, es);
+static void handshake_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    struct tcp_raw_state *es = container_of(watcher, struct tcp_raw_state, io);
+
+    ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
+
+    /* what the client sent meanwhile rides along with the request */
+    struct iovec iov[SOCKS5_PAYLOAD_IOV_MAX];
+    int iovcnt = tcp_raw_buf_iovec(es, iov, SOCKS5_PAYLOAD_IOV_MAX);
+    size_t payload_sent = 0;
+
+    int ret = socks5_handshake_step_payload(watcher->fd, &(es->handshake), iov, iovcnt, &payload_sent);
+    if (ret < 0) {
+        printf("socks5 handshake failed\n");
+        free_all(loop, watcher, es, es->pcb);
+        return;
+    }
+
+    if (payload_sent > 0) {
+        tcp_raw_consume(es, (u32_t) payload_sent);
+        tcp_raw_recved(es->pcb, (u32_t) payload_sent);
+    }
+
+    if (ret == 0) {
+        int events = socks5_handshake_events(&(es->handshake));
+        if ((watcher->events & (EV_READ | EV_WRITE)) != events) {
+            ev_io_stop(loop, watcher);
+            ev_io_set(watcher, watcher->fd, events);
+            ev_io_start(loop, watcher);
+        }
+        return;
+    }
+
+    if (es->handshake.payload_sent) {
+        stats.socks_payload_pipelined++;
+    }
+
+    /* tunnel is ready, relay upstream data and flush what lwip buffered meanwhile */
+    ev_io_stop(loop, watcher);
+    ev_io_init(watcher, read_cb, watcher->fd, EV_READ);
+    ev_io_start(loop, watcher);
+
+    if (es->buf_len > 0) {
+        tcp_raw_send(es->pcb, es);
+    } else if (es->state == ES_CLOSING) {
+        free_all(loop, watcher, es, es->pcb);
+    }
+}
+
+/**
+ * host and address type to CONNECT to for a destination, flows to the fake range connect by domain name
+ * and the proxy resolves it. -1 for a fake address with no domain, e.g. after a restart
+ */
+static int
+tcp_raw_dst(u32_t addr, const char *addr_str, const char **host, int *atype) {
+    *host = addr_str;
+    *atype = 1;
+    if (fake_ip_contains(addr)) {
+        *host = fake_ip_domain(addr);
+        if (*host == NULL) {
+            printf("tcp to a fake ip %s with no domain, reset\n", addr_str);
+            stats.fake_ip_unknown++;
+            return -1;
+        }
+        *atype = 3;
+    }
+    return 0;
+}
+
+/**
+ * answer a SYN lwip never saw with a RST
+ */
+static void
+tcp_raw_rst(struct netif *inp, u32_t src, u16_t sport, u32_t dst, u16_t dport, u32_t seqno) {
+    struct pbuf *q = pbuf_alloc(PBUF_IP, TCP_HLEN, PBUF_RAM);
+    ip4_addr_t local, remote;
+
+    if (q == NULL) {
+        return;
+    }
+    struct tcp_hdr *tcphdr = (struct tcp_hdr *) q->payload;
+    memset(tcphdr, 0, TCP_HLEN);
+    tcphdr->src = lwip_htons(dport);
+    tcphdr->dest = lwip_htons(sport);
+    tcphdr->ackno = lwip_htonl(seqno + 1);
+    TCPH_HDRLEN_FLAGS_SET(tcphdr, TCP_HLEN / 4, TCP_RST | TCP_ACK);
+
+    ip4_addr_set_u32(&local, dst);
+    ip4_addr_set_u32(&remote, src);
+    tcphdr->chksum = inet_chksum_pseudo(q, IP_PROTO_TCP, q->tot_len, &local, &remote);
+    ip4_output_if(q, &local, &remote, TCP_TTL, 0, IP_PROTO_TCP, inp);
+    pbuf_free(q);
+}
+
+static void
+tcp_raw_syn_free(struct tcp_raw_syn *syn, int close_fd) {
+    struct tcp_raw_syn **pp;
+
+    for (pp = &syn_list; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == syn) {
+            *pp = syn->next;
+            break;
+        }
+    }
+    ev_io_stop(EV_DEFAULT, &syn->io);
+    ev_timer_stop(EV_DEFAULT, &syn->timer);
+    if (close_fd) {
+        close(syn->io.fd);
+    }
+    if (syn->p != NULL) {
+        pbuf_free(syn->p);
+    }
+    free(syn);
+}
+
+/**
+ * CONNECT failed, tell the client right away: unreachable replies as icmp, anything else as a RST
+ */
+static void
+tcp_raw_syn_fail(struct tcp_raw_syn *syn) {
+    switch (syn->handshake.rep) {
+        case 0x03: // network unreachable
+            icmp_dest_unreach(syn->p, ICMP_DUR_NET);
+            stats.tcp_syn_icmp++;
+            break;
+        case 0x04: // host unreachable
+        case 0x06: // ttl expired
+            icmp_dest_unreach(syn->p, ICMP_DUR_HOST);
+            stats.tcp_syn_icmp++;
+            break;
+        default:
+            tcp_raw_rst(syn->inp, syn->src, syn->sport, syn->dst, syn->dport, syn->seqno);
+            stats.tcp_syn_rst++;
+            break;
+    }
+    tcp_raw_syn_free(syn, 1);
+}
+
+static void
+syn_timeout_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    struct tcp_raw_syn *syn = container_of(watcher, struct tcp_raw_syn, timer);
+
+    if (syn->ready) {
+        /* the client gave up before its handshake with lwip completed */
+        tcp_raw_syn_free(syn, 1);
+        return;
+    }
+    printf("socks5 connect for a held syn timed out\n");
+    tcp_raw_syn_fail(syn);
+}
+
+static void
+syn_handshake_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    struct tcp_raw_syn *syn = container_of(watcher, struct tcp_raw_syn, io);
+
+    int ret = socks5_handshake_step(watcher->fd, &syn->handshake);
+    if (ret < 0) {
+        tcp_raw_syn_fail(syn);
+        return;
+    }
+    if (ret == 0) {
+        int events = socks5_handshake_events(&syn->handshake);
+        if ((watcher->events & (EV_READ | EV_WRITE)) != events) {
+            ev_io_stop(loop, watcher);
+            ev_io_set(watcher, watcher->fd, events);
+            ev_io_start(loop, watcher);
+        }
+        return;
+    }
+
+    /* upstream is there, let lwip answer the SYN, tcp_raw_ip4_input_hook passes it on now */
+    ev_io_stop(loop, watcher);
+    syn->ready = 1;
+    ev_timer_stop(loop, &syn->timer);
+    ev_timer_set(&syn->timer, TCP_RAW_SYN_TIMEOUT, 0.);
+    ev_timer_start(loop, &syn->timer);
+
+    struct pbuf *p = syn->p;
+    syn->p = NULL;
+    stats.tcp_syn_connected++;
+    ip4_input(p, syn->inp);
+}
+
+static struct tcp_raw_syn *
+tcp_raw_syn_find(u32_t src, u16_t sport, u32_t dst, u16_t dport) {
+    struct tcp_raw_syn *syn;
+
+    for (syn = syn_list; syn != NULL; syn = syn->next) {
+        if (syn->src == src && syn->sport == sport && syn->dst == dst && syn->dport == dport) {
+            return syn;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * the socks connection a held SYN already established for this pcb, NULL if there is none
+ */
+static struct tcp_raw_syn *
+tcp_raw_syn_take(struct tcp_pcb *newpcb) {
+    struct tcp_raw_syn *syn;
+
+    if (syn_list == NULL) {
+        return NULL;
+    }
+    syn = tcp_raw_syn_find(ip_addr_get_ip4_u32(&newpcb->remote_ip), newpcb->remote_port,
+                           ip_addr_get_ip4_u32(&newpcb->local_ip), newpcb->local_port);
+    if (syn == NULL || !syn->ready) {
+        return NULL;
+    }
+    return syn;
+}
+
+/**
+ * LWIP_HOOK_IP4_INPUT: with tcp_connect_first a new SYN is kept from lwip until the socks CONNECT
+ * for it succeeds, so a failed CONNECT resets the client before its handshake completes.
+ * return 1 if the packet was taken
+ */
+extern "C" int
+tcp_raw_ip4_input_hook(struct pbuf *p, struct netif *inp) {
+    if (!tcp_connect_first || p->len < IP_HLEN) {
+        return 0;
+    }
+
+    const struct ip_hdr *iphdr = (const struct ip_hdr *) p->payload;
+    u16_t iphdr_hlen = (u16_t) (IPH_HL(iphdr) * 4);
+    if (IPH_V(iphdr) != 4 || IPH_PROTO(iphdr) != IP_PROTO_TCP ||
+        (IPH_OFFSET(iphdr) & PP_HTONS(IP_OFFMASK | IP_MF)) != 0 || p->len < iphdr_hlen + TCP_HLEN) {
+        return 0;
+    }
+    const struct tcp_hdr *tcphdr = (const struct tcp_hdr *) ((const u8_t *) p->payload + iphdr_hlen);
+    if ((TCPH_FLAGS(tcphdr) & (TCP_SYN | TCP_ACK | TCP_RST)) != TCP_SYN) {
+        return 0;
+    }
+
+    u32_t src = ip4_addr_get_u32(&iphdr->src);
+    u32_t dst = ip4_addr_get_u32(&iphdr->dest);
+    u16_t sport = lwip_ntohs(tcphdr->src);
+    u16_t dport = lwip_ntohs(tcphdr->dest);
+    u32_t seqno = lwip_ntohl(tcphdr->seqno);
+
+    struct tcp_raw_syn *syn = tcp_raw_syn_find(src, sport, dst, dport);
+    if (syn != NULL) {
+        if (syn->ready) {
+            /* retransmitted SYN, lwip answers it again */
+            return 0;
+        }
+        /* still connecting, the client retransmits */
+        pbuf_free(p);
+        return 1;
+    }
+
+    char dst_str[INET_ADDRSTRLEN];
+    const char *host;
+    int atype;
+    inet_ntop(AF_INET, &iphdr->dest, dst_str, INET_ADDRSTRLEN);
+    if (tcp_raw_dst(dst, dst_str, &host, &atype) < 0) {
+        tcp_raw_rst(inp, src, sport, dst, dport, seqno);
+        stats.tcp_syn_rst++;
+        pbuf_free(p);
+        return 1;
+    }
+
+    int socks_fd = socks5_pool_get();
+    int negotiated = socks_fd >= 0;
+    if (!negotiated) {
+        socks_fd = socks5_connect_nonblock(conf->socks_server, conf->socks_port);
+    }
+    syn = (struct tcp_raw_syn *) malloc(sizeof(struct tcp_raw_syn));
+    struct pbuf *q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (socks_fd < 1 || syn == NULL || q == NULL || pbuf_copy(q, p) != ERR_OK) {
+        printf("socks5 connect for a held syn failed\n");
+        if (socks_fd > 0) {
+            close(socks_fd);
+        }
+        free(syn);
+        if (q != NULL) {
+            pbuf_free(q);
+        }
+        tcp_raw_rst(inp, src, sport, dst, dport, seqno);
+        stats.tcp_syn_rst++;
+        pbuf_free(p);
+        return 1;
+    }
+    /* the netif buffer goes back right away, the SYN is all that is kept */
+    pbuf_free(p);
+
+    memset(syn, 0, sizeof(struct tcp_raw_syn));
+    syn->p = q;
+    syn->inp = inp;
+    syn->src = src;
+    syn->dst = dst;
+    syn->sport = sport;
+    syn->dport = dport;
+    syn->seqno = seqno;
+
+    char port[8];
+    sprintf(port, "%d", dport);
+    if (negotiated) {
+        socks5_handshake_init_negotiated(&syn->handshake, host, port, SOCKS5_CMD_CONNECT, atype);
+    } else {
+        socks5_handshake_init(&syn->handshake, host, port, SOCKS5_CMD_CONNECT, atype);
+    }
+
+    ev_io_init(&syn->io, syn_handshake_cb, socks_fd, socks5_handshake_events(&syn->handshake));
+    ev_io_start(EV_DEFAULT, &syn->io);
+    ev_timer_init(&syn->timer, syn_timeout_cb, TCP_RAW_SYN_TIMEOUT, 0.);
+    ev_timer_start(EV_DEFAULT, &syn->timer);
+
+    syn->next = syn_list;
+    syn_list = syn;
+    stats.tcp_syn_held++;
+    return 1;
 }
 
 static err_t
@@ -370,6 +992,10 @@ tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
        new pcbs of higher priority. */
     tcp_setprio(newpcb, TCP_PRIO_MIN);
 
+    if (tso_mss > newpcb->mss) {
+        tcp_raw_raise_mss(newpcb);
+    }
+
     /**
      * local ip local port <-> remote ip remote port
      */
@@ -381,12 +1007,29 @@ tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     // flow 119.23.211.95:80 <-> 172.16.0.1:53536
     // printf("<--------------------- tcp flow %s:%d <-> %s:%d\n", localip_str, newpcb->local_port, remoteip_str, newpcb->remote_port);
 
-    /**
-     * socks 5
-     */
-    int socks_fd = 0;
+    /* with tcp_connect_first the tunnel is already up */
+    struct tcp_raw_syn *syn = tcp_raw_syn_take(newpcb);
+    const char *dst_host = localip_str;
+    int atype = 1;
+    int socks_fd = -1;
+    int negotiated = 0;
 
-    socks_fd = socks5_connect(conf->socks_server, conf->socks_port);
+    if (syn != NULL) {
+        socks_fd = syn->io.fd;
+    } else {
+        if (tcp_raw_dst(ip_addr_get_ip4_u32(&newpcb->local_ip), localip_str, &dst_host, &atype) < 0) {
+            return ERR_VAL;
+        }
+
+        /**
+         * socks 5, the handshake is driven by handshake_cb, a pooled connection only sends the request
+         */
+        socks_fd = socks5_pool_get();
+        negotiated = socks_fd >= 0;
+        if (!negotiated) {
+            socks_fd = socks5_connect_nonblock(conf->socks_server, conf->socks_port);
+        }
+    }
     if (socks_fd < 1) {
         printf("socks5 connect failed\n");
         return -1;
@@ -395,19 +1038,9 @@ tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     char port[64];
     sprintf(port, "%d", newpcb->local_port);
 
-    int ret = socks5_auth(socks_fd, localip_str, port, 0x01, 1);
-    if (ret < 0) {
-        printf("socks5 auth error\n");
-        return -1;
-    }
-
     es = (tcp_raw_state *) malloc(sizeof(tcp_raw_state));
     memset(es, 0, sizeof(tcp_raw_state));
 
-    es->block_ctx = (timer_ctx *) malloc(sizeof(timer_ctx));
-    memset(es->block_ctx, 0, sizeof(timer_ctx));
-    es->block_ctx->raw_state = es;
-
     es->timeout_ctx = (timer_ctx *) malloc(sizeof(timer_ctx));
     memset(es->timeout_ctx, 0, sizeof(timer_ctx));
     es->timeout_ctx->raw_state = es;
@@ -417,20 +1050,36 @@ tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
         es->pcb = newpcb;
         es->retries = 0;
 
-        es->buf_used = 0;
-        es->socks_buf_used = 0;
+        es->buf = NULL;
+        es->buf_tail = NULL;
+        es->buf_len = 0;
+        es->buf_off = 0;
+        ringbuf_init(&es->socks_buf, tcp_nocopy ? TCP_RAW_SOCKS_BUF_NOCOPY_SIZE : TCP_RAW_SOCKS_BUF_SIZE);
+        es->socks_buf_inflight = 0;
         es->lwip_blocked = 0;
+        es->socks_eof = 0;
 
         es->socks_fd = socks_fd;
+        if (syn != NULL) {
+            es->handshake = syn->handshake;
+            tcp_raw_syn_free(syn, 0);
+        } else if (negotiated) {
+            socks5_handshake_init_negotiated(&(es->handshake), dst_host, port, SOCKS5_CMD_CONNECT, atype);
+        } else {
+            socks5_handshake_init(&(es->handshake), dst_host, port, SOCKS5_CMD_CONNECT, atype);
+        }
 
 
         ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, timeout, 0.);
         ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
 
-        ev_timer_init(&(es->block_ctx->watcher), block_cb, 0.1, 0.);
-
-        ev_io_init(&(es->io), read_cb, socks_fd, EV_READ);
+        if (es->handshake.stage == SOCKS5_STAGE_ESTABLISHED) {
+            ev_io_init(&(es->io), read_cb, socks_fd, EV_READ);
+        } else {
+            ev_io_init(&(es->io), handshake_cb, socks_fd, socks5_handshake_events(&(es->handshake)));
+        }
         ev_io_start(EV_DEFAULT, &(es->io));
+        ev_io_init(&(es->write_io), write_cb, socks_fd, EV_WRITE);
 
         /**
          * enable tcp keepalive
@@ -452,8 +1101,37 @@ tcp_raw_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     return ret_err;
 }
 
+void
+tcp_raw_set_tso_mss(u16_t mss) {
+    tso_mss = mss;
+}
+
+u16_t
+tcp_raw_peer_mss(u32_t src, u16_t sport, u32_t dst, u16_t dport) {
+    struct tcp_raw_flow_key key;
+
+    key.src = src;
+    key.dst = dst;
+    key.sport = sport;
+    key.dport = dport;
+    auto it = peer_mss.find(key);
+    return it == peer_mss.end() ? 0 : it->second;
+}
+
+void
+tcp_raw_set_nocopy(int nocopy) {
+    tcp_nocopy = nocopy;
+}
+
+void
+tcp_raw_set_connect_first(int connect_first) {
+    tcp_connect_first = connect_first;
+}
+
 void
 tcp_raw_init(void) {
+    peer_mss_id = tcp_ext_arg_alloc_id();
+    linger_id = tcp_ext_arg_alloc_id();
     tcp_raw_pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
     if (tcp_raw_pcb != NULL) {
         err_t err;
@@ -7,6 +7,18 @@
 #include "lwip/ip6.h"
 #include "ev.h"
 
+#include "socks5.h"
+#include "ringbuf.h"
+
+/* socks -> lwip, reading upstream pauses once it is full and resumes below the low watermark */
+#define TCP_RAW_SOCKS_BUF_SIZE 0x10000
+/* with tcp_nocopy unacked bytes stay in socks_buf, room for a whole TCP_SND_BUF */
+#define TCP_RAW_SOCKS_BUF_NOCOPY_SIZE 0x40000
+/* lwip -> socks, smaller payloads waiting behind others are copied out of the tun rx buffer they pin */
+#define TCP_RAW_QUEUE_COPY_MAX 0x4000
+/* seconds a held SYN waits for the socks CONNECT, and then for the client to complete its handshake */
+#define TCP_RAW_SYN_TIMEOUT 10.
+
 enum tcp_raw_states {
     ES_NONE = 0,
     ES_ACCEPTED,
@@ -21,19 +33,32 @@ typedef struct timer_ctx {
 
 typedef struct tcp_raw_state {
     ev_io io;
+    ev_io write_io; // armed only while buf has bytes the socks socket did not take
     struct timer_ctx *timeout_ctx;
-    struct timer_ctx *block_ctx;
     u8_t state;
     u8_t retries;
     struct tcp_pcb *pcb;
     int socks_fd;
-    std::string buf;
-    u16_t buf_used;
-    std::string socks_buf;
-    u16_t socks_buf_used;
-    int lwip_blocked;
+    socks5_handshake_t handshake;
+    struct pbuf *buf; // lwip -> socks, received pbufs linked in order and sent from their payload
+    struct pbuf *buf_tail;
+    u32_t buf_len; // bytes queued in buf, its tot_len is not kept up to date across pbufs
+    u16_t buf_off; // bytes of the first pbuf already sent
+    ringbuf_t socks_buf;
+    u32_t socks_buf_inflight; // head of socks_buf lwip references until it is acked (tcp_nocopy)
+    int lwip_blocked; // upstream read watcher stopped until lwip takes socks_buf
+    int socks_eof; // upstream closed, close once socks_buf is in lwip
 } tcp_raw_state;
 
 void tcp_raw_init(void);
 
+void tcp_raw_set_tso_mss(u16_t mss);
+
+/* mss a flow's client accepts when lwip sends it tso_mss segments, 0 if unknown, see tunif_conf */
+u16_t tcp_raw_peer_mss(u32_t src, u16_t sport, u32_t dst, u16_t dport);
+
+void tcp_raw_set_nocopy(int nocopy);
+
+void tcp_raw_set_connect_first(int connect_first);
+
 #endif /* LWIP_TCP_RAW_H */
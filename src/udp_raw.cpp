@@ -3,6 +3,7 @@
  */
 #include <iostream>
 #include <fstream>
+#include <unordered_map>
 #include <vector>
 
 #include "lwip/ip6.h"
@@ -11,15 +12,25 @@
 #include "ev.h"
 #include "socket_util.h"
 
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(LWIP_UNIX_LINUX)
+#include <linux/udp.h>
+#endif
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <arpa/nameser.h>
 
 #include "dns/dns_parser.h"
 #include "udp_raw.h"
 #include "struct.h"
 #include "socks5.h"
+#include "socks5_pool.h"
 #include "util.h"
 #include "var.h"
+#include "fake_ip.h"
+#include "stats.h"
 
 #if LWIP_UDP
 
@@ -28,6 +39,40 @@ typedef struct udp_timer_ctx {
     struct udp_raw_state *raw_state;
 } udp_timer_ctx;
 
+/* src ip:port -> dst ip:port of a relayed flow, network order addresses */
+struct udp_nat_key {
+    u32_t src;
+    u32_t dst;
+    u16_t sport;
+    u16_t dport;
+
+    bool operator==(const udp_nat_key &other) const {
+        return src == other.src && dst == other.dst && sport == other.sport && dport == other.dport;
+    }
+};
+
+struct udp_nat_key_hash {
+    size_t operator()(const udp_nat_key &key) const {
+        uint64_t addrs = (uint64_t) key.src << 32 | key.dst;
+        uint64_t ports = (uint64_t) key.sport << 16 | key.dport;
+        return std::hash<uint64_t>()(addrs ^ ports * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+/**
+ * a udp associate shared by many flows, replies are told apart by the address in their header
+ */
+struct udp_assoc {
+    ev_io io; // relay socket
+    ev_io ctrl_io; // socks control connection
+    ev_timer timer; // handshake timeout
+    socks5_handshake_t handshake;
+    int ready; // relay address known
+    struct sockaddr_in addr; // relay address
+    int slot;
+    std::unordered_map<std::string, struct udp_raw_state *> *flows; // by ATYP ADDR PORT
+};
+
 struct udp_raw_state {
     ev_io io;
     struct udp_timer_ctx *timeout_ctx;
@@ -39,6 +84,23 @@ struct udp_raw_state {
     char addr_ip[INET_ADDRSTRLEN]; // origin sendto ip address
     ssize_t addr_len;
     u16_t udp_port; // origin sendto port
+
+    /* relay sessions, see udp_nat_open */
+    ev_io ctrl_io; // socks control connection, the association ends with it
+    u8_t nat;
+    u8_t nat_once; // a dns query, closed after its answer
+    u8_t ready; // associate done, datagrams go out, queued until then
+    socks5_handshake_t handshake;
+    struct pbuf *queue[UDP_NAT_QUEUE_MAX];
+    int queue_len;
+    struct udp_nat_key key;
+    struct udp_assoc *assoc; // NULL if the session has an associate of its own
+    ip_addr_t remote_fake_ip; // flow destination, replies go out from it
+    u16_t remote_fake_port;
+    char hdr[SOCKS5_REPLY_MAX_SIZE]; // socks udp request header in front of each datagram
+    size_t hdr_len;
+    struct udp_raw_state *prev; // lru list, head is the most recently used
+    struct udp_raw_state *next;
 };
 
 typedef struct {
@@ -50,6 +112,50 @@ static ev_tstamp timeout = 60.;
 
 static struct udp_pcb *udp_raw_pcb;
 
+static size_t nat_max = UDP_NAT_MAX;
+static ev_tstamp nat_timeout = UDP_NAT_TIMEOUT;
+static std::unordered_map<udp_nat_key, struct udp_raw_state *, udp_nat_key_hash> nat_table;
+static struct udp_raw_state *nat_head = NULL;
+static struct udp_raw_state *nat_tail = NULL;
+
+#if !defined(LWIP_UNIX_LINUX)
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+/* datagrams to the relays queued during a loop iteration, sent by udp_raw_flush */
+static struct mmsghdr tx_msgs[UDP_RELAY_BATCH];
+static struct iovec tx_iov[UDP_RELAY_BATCH][UDP_RELAY_IOV];
+static struct pbuf *tx_pbufs[UDP_RELAY_BATCH]; // payloads, held until sent
+static int tx_fds[UDP_RELAY_BATCH];
+static int tx_count = 0;
+
+/* replies read in one call, only the pages a datagram lands on get touched */
+static struct mmsghdr rx_msgs[UDP_RELAY_BATCH];
+static struct iovec rx_iov[UDP_RELAY_BATCH];
+static char rx_bufs[UDP_RELAY_BATCH][UDP_RELAY_BUFFER_SIZE];
+static size_t rx_segs[UDP_RELAY_BATCH]; // datagram size in a gro read, its length otherwise
+
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+static int udp_tx_gso = 0; // UDP_SEGMENT merged sends, turned off if the route cannot segment
+static int udp_rx_gro = 0; // UDP_GRO on new relay sockets, reads are split either way
+static size_t udp_gso_max_seg = UDP_GSO_MAX_SEG; // larger datagrams are never merged
+
+/* the queue as it goes out, runs of equal-size datagrams to one relay merged into UDP_SEGMENT sends */
+static struct mmsghdr out_msgs[UDP_RELAY_BATCH];
+static struct iovec out_iov[UDP_RELAY_BATCH * UDP_RELAY_IOV];
+static char out_ctrl[UDP_RELAY_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+static int out_segs[UDP_RELAY_BATCH];
+static int out_first[UDP_RELAY_BATCH]; // queue index of the first datagram in each send
+
+static char rx_ctrl[UDP_RELAY_BATCH][CMSG_SPACE(sizeof(int))];
+#endif
+
+static std::vector<struct udp_assoc *> assocs; // empty if every session has its own associate
+static size_t assoc_next = 0;
+
 
 static void free_dns_query(ev_io *watcher, struct udp_raw_state *es) {
     // close socks dns socket
@@ -63,49 +169,275 @@ static void free_dns_query(ev_io *watcher, struct udp_raw_state *es) {
     free(es);
 }
 
+static void udp_nat_unlink(struct udp_raw_state *es) {
+    if (es->prev != NULL) {
+        es->prev->next = es->next;
+    } else {
+        nat_head = es->next;
+    }
+    if (es->next != NULL) {
+        es->next->prev = es->prev;
+    } else {
+        nat_tail = es->prev;
+    }
+}
 
-// This callback is called when data is readable on the UDP socket.
-static void udp_socks_relay_cb(EV_P_ ev_io *watcher, int revents) {
-    struct udp_raw_state *es = container_of(watcher, struct udp_raw_state, io);
-    char buff[BUFFER_SIZE];
-    ssize_t nread = recvfrom(watcher->fd, buff, BUFFER_SIZE, 0, (struct sockaddr *) (&(es->addr)),
-                             reinterpret_cast<socklen_t *>(&es->addr_len));
-    if (nread < 0) {
-        printf("udp data recvfrom failed\n");
-        free_dns_query(watcher, es);
-        return;
+static void udp_nat_push(struct udp_raw_state *es) {
+    es->prev = NULL;
+    es->next = nat_head;
+    if (nat_head != NULL) {
+        nat_head->prev = es;
+    } else {
+        nat_tail = es;
     }
-    if (nread == 0) {
-        printf("read EOF from udp socks %d\n", watcher->fd);
-        free_dns_query(watcher, es);
+    nat_head = es;
+}
+
+/**
+ * traffic either way keeps a session at the head of the lru list and restarts its idle timer
+ */
+static void udp_nat_touch(struct udp_raw_state *es) {
+    if (nat_head != es) {
+        udp_nat_unlink(es);
+        udp_nat_push(es);
+    }
+    /* the handshake timeout stands until the associate is done */
+    if (es->ready) {
+        ev_timer_again(EV_DEFAULT, &(es->timeout_ctx->watcher));
+    }
+}
+
+static std::string udp_nat_dst(struct udp_raw_state *es) {
+    return std::string(es->hdr + 3, es->hdr_len - 3);
+}
+
+static void udp_nat_free(struct udp_raw_state *es) {
+    /* queued datagrams point at the header and the fd */
+    udp_raw_flush();
+    nat_table.erase(es->key);
+    udp_nat_unlink(es);
+    for (int i = 0; i < es->queue_len; i++) {
+        pbuf_free(es->queue[i]);
+    }
+    if (es->assoc != NULL) {
+        es->assoc->flows->erase(udp_nat_dst(es));
+        ev_timer_stop(EV_DEFAULT, &(es->timeout_ctx->watcher));
+        free(es->timeout_ctx);
+        free(es);
         return;
     }
+    ev_io_stop(EV_DEFAULT, &(es->ctrl_io));
+    close(es->socks_tcp_fd);
+    free_dns_query(&(es->io), es);
+}
 
-    ev_timer_again(EV_A_ &(es->timeout_ctx->watcher));
+
+/**
+ * read up to UDP_RELAY_BATCH datagrams into rx_bufs, their count or -1
+ */
+static int udp_relay_recv(int fd) {
+#if defined(LWIP_UNIX_LINUX)
+    for (int i = 0; i < UDP_RELAY_BATCH; i++) {
+        rx_iov[i].iov_base = rx_bufs[i];
+        rx_iov[i].iov_len = UDP_RELAY_BUFFER_SIZE;
+        memset(&rx_msgs[i], 0, sizeof(struct mmsghdr));
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+        /* a socket opened with UDP_GRO keeps coalescing, whatever happened to udp_tx_gso since */
+        rx_msgs[i].msg_hdr.msg_control = rx_ctrl[i];
+        rx_msgs[i].msg_hdr.msg_controllen = sizeof(rx_ctrl[i]);
+#endif
+    }
+    int n = recvmmsg(fd, rx_msgs, UDP_RELAY_BATCH, MSG_DONTWAIT, NULL);
+#else
+    ssize_t nread = recv(fd, rx_bufs[0], UDP_RELAY_BUFFER_SIZE, 0);
+    int n = nread < 0 ? -1 : 1;
+    if (n > 0) {
+        rx_msgs[0].msg_len = (unsigned int) nread;
+    }
+#endif
+    if (n > 0) {
+        stats.udp_rx_syscalls++;
+    }
+    for (int i = 0; i < n; i++) {
+        rx_segs[i] = rx_msgs[i].msg_len;
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&rx_msgs[i].msg_hdr); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&rx_msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                if (gso_size > 0 && (size_t) gso_size < rx_segs[i]) {
+                    rx_segs[i] = (size_t) gso_size;
+                    stats.udp_rx_gro_reads++;
+                }
+            }
+        }
+#endif
+        if (rx_segs[i] == 0) {
+            /* an empty datagram, still one */
+            rx_segs[i] = 1;
+        }
+        stats.udp_rx_datagrams += (rx_msgs[i].msg_len + rx_segs[i] - 1) / rx_segs[i];
+    }
+    return n;
+}
+
+/**
+ * RSV RSV FRAG ATYP ADDR PORT in front of a relayed reply, -1 if it is cut short.
+ * the server may answer with a domain for fake ip flows
+ */
+static ssize_t udp_reply_hdr_len(const char *buff, ssize_t nread) {
+    ssize_t hdr_len = 10;
+    if (nread > 4 && buff[3] == SOSKC5_ADDRTYPE_DOMAIN) {
+        hdr_len = 4 + 1 + (u_char) buff[4] + 2;
+    } else if (nread > 4 && buff[3] == SOSKC5_ADDRTYPE_IPV6) {
+        hdr_len = 4 + 16 + 2;
+    }
+    return nread < hdr_len ? -1 : hdr_len;
+}
+
+static void udp_nat_reply(struct udp_raw_state *es, const char *data, size_t len) {
+    udp_nat_touch(es);
 
     /* send received packet back to sender */
-    ssize_t data_len = nread - 10;
-    struct pbuf *socksp = pbuf_alloc(PBUF_TRANSPORT, (uint16_t) data_len, PBUF_RAM);
-    memcpy(socksp->payload, buff + 10, (size_t) data_len);
+    struct pbuf *socksp = pbuf_alloc(PBUF_TRANSPORT, (uint16_t) len, PBUF_RAM);
+    if (socksp == NULL) {
+        return;
+    }
+    memcpy(socksp->payload, data, len);
 
     struct in_addr ip;
     ip.s_addr = inet_addr(es->addr_ip);
 
+    /* the shared pcb holds the destination of the last datagram in, answer from this flow's */
+    ip_addr_copy(es->pcb->remote_fake_ip, es->remote_fake_ip);
+    es->pcb->remote_fake_port = es->remote_fake_port;
+
     err_t e = udp_sendto(es->pcb, socksp, reinterpret_cast<const ip_addr_t *>(&ip), es->udp_port);
     /* free the pbuf */
     pbuf_free(socksp);
-    close(es->socks_tcp_fd);
-    free_dns_query(watcher, es);
     if (e != ERR_OK) {
         printf("udp_sendto %d %s\n", e, lwip_strerr(e));
     }
+    if (es->nat_once) {
+        udp_nat_free(es);
+    }
+}
+
+// This callback is called when data is readable on the UDP socket.
+static void udp_socks_relay_cb(EV_P_ ev_io *watcher, int revents) {
+    struct udp_raw_state *es = container_of(watcher, struct udp_raw_state, io);
+    u8_t once = es->nat_once;
+    int n = udp_relay_recv(watcher->fd);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        printf("udp data recvfrom failed\n");
+        udp_nat_free(es);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        /* a gro read holds several datagrams of rx_segs bytes, the last may be shorter */
+        for (size_t off = 0; off < rx_msgs[i].msg_len; off += rx_segs[i]) {
+            char *buff = rx_bufs[i] + off;
+            ssize_t nread = LWIP_MIN(rx_segs[i], rx_msgs[i].msg_len - off);
+            ssize_t hdr_len = udp_reply_hdr_len(buff, nread);
+            if (hdr_len < 0) {
+                printf("udp socks reply too short, drop\n");
+                continue;
+            }
+            udp_nat_reply(es, buff + hdr_len, (size_t) (nread - hdr_len));
+            if (once) {
+                /* es is gone with the answer */
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * nothing is expected on the control connection, EOF or an error ends the association
+ */
+static void udp_nat_ctrl_cb(EV_P_ ev_io *watcher, int revents) {
+    struct udp_raw_state *es = container_of(watcher, struct udp_raw_state, ctrl_io);
+    char buff[64];
+    ssize_t nread = recv(watcher->fd, buff, sizeof(buff), 0);
+    if (nread > 0 || (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+        return;
+    }
+    printf("socks udp association %d closed\n", watcher->fd);
+    udp_nat_free(es);
+}
+
+static void udp_assoc_close(struct udp_assoc *assoc) {
+    udp_raw_flush();
+    while (!assoc->flows->empty()) {
+        udp_nat_free(assoc->flows->begin()->second);
+    }
+    delete assoc->flows;
+    ev_timer_stop(EV_DEFAULT, &(assoc->timer));
+    ev_io_stop(EV_DEFAULT, &(assoc->io));
+    ev_io_stop(EV_DEFAULT, &(assoc->ctrl_io));
+    close(assoc->io.fd);
+    close(assoc->ctrl_io.fd);
+    assocs[assoc->slot] = NULL;
+    free(assoc);
+}
+
+static void udp_assoc_relay_cb(EV_P_ ev_io *watcher, int revents) {
+    struct udp_assoc *assoc = container_of(watcher, struct udp_assoc, io);
+    int n = udp_relay_recv(watcher->fd);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        printf("udp data recvfrom failed\n");
+        udp_assoc_close(assoc);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        for (size_t off = 0; off < rx_msgs[i].msg_len; off += rx_segs[i]) {
+            char *buff = rx_bufs[i] + off;
+            ssize_t nread = LWIP_MIN(rx_segs[i], rx_msgs[i].msg_len - off);
+            ssize_t hdr_len = udp_reply_hdr_len(buff, nread);
+            if (hdr_len < 0) {
+                printf("udp socks reply too short, drop\n");
+                continue;
+            }
+
+            std::unordered_map<std::string, struct udp_raw_state *>::iterator it =
+                    assoc->flows->find(std::string(buff + 3, (size_t) hdr_len - 3));
+            if (it == assoc->flows->end()) {
+                stats.udp_assoc_unmatched++;
+                continue;
+            }
+            udp_nat_reply(it->second, buff + hdr_len, (size_t) (nread - hdr_len));
+        }
+    }
+}
+
+static void udp_assoc_ctrl_cb(EV_P_ ev_io *watcher, int revents) {
+    struct udp_assoc *assoc = container_of(watcher, struct udp_assoc, ctrl_io);
+    char buff[64];
+    ssize_t nread = recv(watcher->fd, buff, sizeof(buff), 0);
+    if (nread > 0 || (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+        return;
+    }
+    printf("shared socks udp association %d closed\n", watcher->fd);
+    udp_assoc_close(assoc);
 }
 
 
 static void dns_relay_cb(EV_P_ ev_io *watcher, int revents) {
     struct udp_raw_state *es = container_of(watcher, struct udp_raw_state, io);
-    char buff[BUFFER_SIZE];
-    ssize_t nread = recvfrom(watcher->fd, buff, BUFFER_SIZE, 0, (struct sockaddr *) (&(es->addr)),
+    char buff[UDP_RELAY_BUFFER_SIZE];
+    ssize_t nread = recvfrom(watcher->fd, buff, UDP_RELAY_BUFFER_SIZE, 0, (struct sockaddr *) (&(es->addr)),
                              reinterpret_cast<socklen_t *>(&es->addr_len));
     if (nread < 0) {
         printf("udp data recvfrom failed\n");
@@ -185,14 +517,433 @@ static void tcp_dns_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
     }
 }
 
+/**
+ * answer A queries from the fake range and AAAA with no records so clients stay on ipv4,
+ * false for other queries, which take the normal path
+ */
+static bool
+fake_dns_reply(struct udp_pcb *upcb, struct pbuf *p, const u_char *query, const ip_addr_t *addr, u16_t port,
+               const std::string &domain) {
+    int qtype = get_query_type(query, p->tot_len);
+    uint32_t fake;
+
+    if (qtype == ns_t_a) {
+        fake = fake_ip_lookup(domain);
+    } else if (qtype == ns_t_aaaa) {
+        fake = 0;
+    } else {
+        return false;
+    }
+
+    u_char reply[UDP_BUFFER_SIZE];
+    int len = build_a_answer(query, p->tot_len, reply, sizeof(reply), fake, fake_ip_ttl());
+    if (len < 0) {
+        return false;
+    }
+
+    struct pbuf *socksp = pbuf_alloc(PBUF_TRANSPORT, (u16_t) len, PBUF_RAM);
+    if (socksp == NULL) {
+        return false;
+    }
+    memcpy(socksp->payload, reply, (size_t) len);
+
+    err_t e = udp_sendto(upcb, socksp, addr, port);
+    pbuf_free(socksp);
+    if (e != ERR_OK) {
+        printf("udp_sendto %d %s in fake_dns_reply\n", e, lwip_strerr(e));
+    }
+    stats.fake_ip_answers++;
+    pbuf_free(p);
+    return true;
+}
+
 static void
 timeout_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
     udp_timer_ctx *timeout_ctx = container_of(watcher, udp_timer_ctx, watcher);
     struct udp_raw_state *es = timeout_ctx->raw_state;
     printf("timeout, clean\n");
+    if (es->nat) {
+        if (es->ready) {
+            stats.udp_nat_expired++;
+        } else {
+            stats.udp_nat_failed++;
+        }
+        udp_nat_free(es);
+        return;
+    }
     free_dns_query(&(es->io), es);
 }
 
+/**
+ * start a non-blocking UDP ASSOCIATE for dst, the control connection or -1.
+ * hs is driven with socks5_handshake_step, a pooled connection only sends the request
+ */
+static int udp_associate_start(struct in_addr dst, int pport, socks5_handshake_t *hs) {
+    char host[INET_ADDRSTRLEN];
+    char port[16];
+    inet_ntop(AF_INET, &dst, host, INET_ADDRSTRLEN);
+    sprintf(port, "%d", pport);
+
+    int socks_fd = socks5_pool_get();
+    if (socks_fd >= 0) {
+        socks5_handshake_init_negotiated(hs, host, port, SOCKS5_CMD_UDPASSOCIATE, 1);
+        return socks_fd;
+    }
+    socks_fd = socks5_connect_nonblock(conf->socks_server, conf->socks_port);
+    if (socks_fd < 0) {
+        printf("socks5 connect failed\n");
+        return -1;
+    }
+    socks5_handshake_init(hs, host, port, SOCKS5_CMD_UDPASSOCIATE, 1);
+    return socks_fd;
+}
+
+/**
+ * relay address from the associate reply, the socks server's if it names 0.0.0.0 or no ipv4 address
+ */
+static void udp_associate_relay(const socks5_handshake_t *hs, struct sockaddr_in *relay) {
+    memset(relay, 0, sizeof(struct sockaddr_in));
+    relay->sin_family = AF_INET;
+    relay->sin_addr.s_addr = inet_addr(conf->socks_server);
+    /* BND.PORT ends the reply whatever the address type */
+    memcpy(&relay->sin_port, hs->res + hs->res_len - 2, 2);
+    if (hs->res[3] == SOSKC5_ADDRTYPE_IPV4) {
+        u32_t bnd;
+        memcpy(&bnd, hs->res + 4, 4);
+        if (bnd != htonl(INADDR_ANY)) {
+            relay->sin_addr.s_addr = bnd;
+        }
+    }
+}
+
+/**
+ * keep waiting for what the handshake needs next, 0 if done, -1 if it failed
+ */
+static int udp_associate_step(struct ev_loop *loop, ev_io *watcher, socks5_handshake_t *hs) {
+    int ret = socks5_handshake_step(watcher->fd, hs);
+    if (ret < 0) {
+        printf("socks 5 udp associate failed\n");
+        return -1;
+    }
+    if (ret == 1) {
+        return 0;
+    }
+
+    int events = socks5_handshake_events(hs);
+    if ((watcher->events & (EV_READ | EV_WRITE)) != events) {
+        ev_io_stop(loop, watcher);
+        ev_io_set(watcher, watcher->fd, events);
+        ev_io_start(loop, watcher);
+    }
+    return 1;
+}
+
+static void udp_nat_send(struct udp_raw_state *es, struct pbuf *p);
+
+/**
+ * relay known: send what queued up during the handshake and switch to the idle timeout
+ */
+static void udp_nat_ready(struct udp_raw_state *es) {
+    es->ready = 1;
+    ev_timer_again(EV_DEFAULT, &(es->timeout_ctx->watcher));
+    for (int i = 0; i < es->queue_len; i++) {
+        udp_nat_send(es, es->queue[i]);
+    }
+    es->queue_len = 0;
+}
+
+static void udp_nat_handshake_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    struct udp_raw_state *es = container_of(watcher, struct udp_raw_state, ctrl_io);
+    int ret = udp_associate_step(loop, watcher, &(es->handshake));
+    if (ret < 0) {
+        stats.udp_nat_failed++;
+        udp_nat_free(es);
+        return;
+    }
+    if (ret > 0) {
+        return;
+    }
+
+    udp_associate_relay(&(es->handshake), &(es->addr));
+    ev_io_stop(loop, watcher);
+    ev_io_init(watcher, udp_nat_ctrl_cb, watcher->fd, EV_READ);
+    ev_io_start(loop, watcher);
+    udp_nat_ready(es);
+}
+
+static void udp_assoc_handshake_cb(struct ev_loop *loop, ev_io *watcher, int revents) {
+    struct udp_assoc *assoc = container_of(watcher, struct udp_assoc, ctrl_io);
+    int ret = udp_associate_step(loop, watcher, &(assoc->handshake));
+    if (ret < 0) {
+        stats.udp_nat_failed++;
+        udp_assoc_close(assoc);
+        return;
+    }
+    if (ret > 0) {
+        return;
+    }
+
+    udp_associate_relay(&(assoc->handshake), &(assoc->addr));
+    assoc->ready = 1;
+    ev_timer_stop(loop, &(assoc->timer));
+    ev_io_stop(loop, watcher);
+    ev_io_init(watcher, udp_assoc_ctrl_cb, watcher->fd, EV_READ);
+    ev_io_start(loop, watcher);
+
+    std::unordered_map<std::string, struct udp_raw_state *>::iterator it;
+    for (it = assoc->flows->begin(); it != assoc->flows->end(); ++it) {
+        it->second->addr = assoc->addr;
+        udp_nat_ready(it->second);
+    }
+}
+
+static void udp_assoc_timeout_cb(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    struct udp_assoc *assoc = container_of(watcher, struct udp_assoc, timer);
+    printf("shared socks udp associate timeout\n");
+    stats.udp_nat_failed++;
+    udp_assoc_close(assoc);
+}
+
+static int udp_relay_socket(void) {
+    int udp_relay_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_relay_fd < 0) {
+        return -1;
+    }
+    setnonblocking(udp_relay_fd);
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+    if (udp_rx_gro) {
+        int opt = 1;
+        setsockopt(udp_relay_fd, IPPROTO_UDP, UDP_GRO, &opt, sizeof(opt));
+    }
+#endif
+
+    sockaddr_in localAddr;
+    memset(&localAddr, 0, sizeof(localAddr));
+    localAddr.sin_family = AF_INET;
+    localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    localAddr.sin_port = htons(0);
+    if (bind(udp_relay_fd, (struct sockaddr *) &localAddr, sizeof(localAddr)) < 0) {
+        printf("bind udp relay failed\n");
+        close(udp_relay_fd);
+        return -1;
+    }
+    return udp_relay_fd;
+}
+
+static struct udp_assoc *udp_assoc_open(int slot) {
+    struct udp_assoc *assoc = (struct udp_assoc *) malloc(sizeof(struct udp_assoc));
+    memset(assoc, 0, sizeof(struct udp_assoc));
+
+    /* the address and port datagrams come from are not known up front */
+    struct in_addr any;
+    any.s_addr = htonl(INADDR_ANY);
+    int socks_fd = udp_associate_start(any, 0, &(assoc->handshake));
+    if (socks_fd < 0) {
+        free(assoc);
+        return NULL;
+    }
+    int udp_relay_fd = udp_relay_socket();
+    if (udp_relay_fd < 0) {
+        close(socks_fd);
+        free(assoc);
+        return NULL;
+    }
+
+    assoc->slot = slot;
+    assoc->flows = new std::unordered_map<std::string, struct udp_raw_state *>();
+
+    ev_io_init(&(assoc->io), udp_assoc_relay_cb, udp_relay_fd, EV_READ);
+    ev_io_start(EV_DEFAULT, &(assoc->io));
+    ev_io_init(&(assoc->ctrl_io), udp_assoc_handshake_cb, socks_fd, socks5_handshake_events(&(assoc->handshake)));
+    ev_io_start(EV_DEFAULT, &(assoc->ctrl_io));
+    ev_timer_init(&(assoc->timer), udp_assoc_timeout_cb, UDP_NAT_CONNECT_TIMEOUT, 0.);
+    ev_timer_start(EV_DEFAULT, &(assoc->timer));
+
+    assocs[slot] = assoc;
+    stats.udp_assoc_opened++;
+    return assoc;
+}
+
+/**
+ * next shared associate with no flow to dst yet, replies to two would be ambiguous.
+ * NULL if every one has such a flow or one could not be set up
+ */
+static struct udp_assoc *udp_assoc_pick(const std::string &dst) {
+    for (size_t i = 0; i < assocs.size(); i++) {
+        size_t slot = (assoc_next + i) % assocs.size();
+        struct udp_assoc *assoc = assocs[slot];
+        if (assoc == NULL && (assoc = udp_assoc_open((int) slot)) == NULL) {
+            return NULL;
+        }
+        if (assoc->flows->count(dst) == 0) {
+            assoc_next = slot + 1;
+            return assoc;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * session for a new flow: the request header for its datagrams and a udp associate, shared
+ * when udp_associations is set, kept until the flow goes idle or the lru evicts it
+ */
+static struct udp_raw_state *
+udp_nat_open(struct udp_pcb *upcb, const ip_addr_t *addr, u16_t port, const struct udp_nat_key &key,
+             const char *fake_domain, const char *domain) {
+    bool dns = strcmp("udp", conf->dns_mode) == 0 && upcb->remote_fake_port == atoi(conf->local_dns_port);
+    struct in_addr dst;
+    int pport;
+
+    if (dns) {
+        inet_aton(conf->remote_dns_server, &dst);
+        pport = atoi(conf->remote_dns_port);
+        printf("UDP dns query %s redirect to remote dns server %s\n", domain, conf->remote_dns_server);
+    } else {
+        dst.s_addr = key.dst;
+        pport = key.dport;
+        printf("UDP via socks 5 udp tunnel to %s\n", inet_ntoa(dst));
+    }
+
+    /* RSV RSV FRAG ATYP ADDR PORT */
+    char hdr[SOCKS5_REPLY_MAX_SIZE];
+    size_t idx = 0;
+    hdr[idx++] = 0;
+    hdr[idx++] = 0;
+    hdr[idx++] = 0;
+    if (fake_domain != NULL) {
+        size_t domain_len = LWIP_MIN(strlen(fake_domain), 255);
+        hdr[idx++] = SOSKC5_ADDRTYPE_DOMAIN;
+        hdr[idx++] = (char) domain_len;
+        memcpy(hdr + idx, fake_domain, domain_len);
+        idx += domain_len;
+    } else {
+        hdr[idx++] = 1; /* ATYP: IPv4 = 1 */
+        memcpy(hdr + idx, &dst.s_addr, 4);
+        idx += 4;
+    }
+    hdr[idx++] = (unsigned char) ((pport >> 8) & 0xff); /* PORT MSB */
+    hdr[idx++] = (unsigned char) (pport & 0xff);        /* PORT LSB */
+
+    /* servers may answer domain flows from the resolved address, those keep their own associate */
+    struct udp_assoc *assoc = NULL;
+    if (!assocs.empty() && fake_domain == NULL) {
+        assoc = udp_assoc_pick(std::string(hdr + 3, idx - 3));
+    }
+
+    socks5_handshake_t hs;
+    int socks_fd = -1;
+    int udp_relay_fd = -1;
+    if (assoc == NULL) {
+        socks_fd = udp_associate_start(dst, pport, &hs);
+        if (socks_fd < 0) {
+            return NULL;
+        }
+        udp_relay_fd = udp_relay_socket();
+        if (udp_relay_fd < 0) {
+            close(socks_fd);
+            return NULL;
+        }
+        if (!assocs.empty()) {
+            stats.udp_assoc_dedicated++;
+        }
+    }
+
+    if (nat_table.size() >= nat_max && nat_tail != NULL) {
+        stats.udp_nat_evicted++;
+        udp_nat_free(nat_tail);
+    }
+
+    struct udp_raw_state *es = (struct udp_raw_state *) malloc(sizeof(struct udp_raw_state));
+    memset(es, 0, sizeof(struct udp_raw_state));
+    es->pcb = upcb;
+    es->state = 0;
+    es->retries = 0;
+    es->udp_port = port;
+    inet_ntop(AF_INET, addr, es->addr_ip, INET_ADDRSTRLEN);
+    es->addr_len = sizeof(sockaddr_in);
+    es->socks_tcp_fd = socks_fd;
+
+    es->nat = 1;
+    es->nat_once = dns;
+    es->key = key;
+    es->assoc = assoc;
+    ip_addr_copy(es->remote_fake_ip, upcb->remote_fake_ip);
+    es->remote_fake_port = upcb->remote_fake_port;
+    memcpy(es->hdr, hdr, idx);
+    es->hdr_len = idx;
+
+    es->timeout_ctx = (udp_timer_ctx *) malloc(sizeof(udp_timer_ctx));
+    memset(es->timeout_ctx, 0, sizeof(udp_timer_ctx));
+    es->timeout_ctx->raw_state = es;
+
+    // the handshake timeout first, then repeat so that ev_timer_again restarts the idle timer
+    ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, UDP_NAT_CONNECT_TIMEOUT, nat_timeout);
+    ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
+
+    nat_table[key] = es;
+    udp_nat_push(es);
+    stats.udp_nat_opened++;
+
+    if (assoc != NULL) {
+        (*assoc->flows)[udp_nat_dst(es)] = es;
+        if (assoc->ready) {
+            es->addr = assoc->addr;
+            udp_nat_ready(es);
+        }
+    } else {
+        es->handshake = hs;
+        ev_io_init(&(es->io), udp_socks_relay_cb, udp_relay_fd, EV_READ);
+        ev_io_start(EV_DEFAULT, &(es->io));
+        ev_io_init(&(es->ctrl_io), udp_nat_handshake_cb, socks_fd, socks5_handshake_events(&(es->handshake)));
+        ev_io_start(EV_DEFAULT, &(es->ctrl_io));
+    }
+    return es;
+}
+
+/**
+ * queue header and datagram for udp_raw_flush, p is held rather than copied and freed once sent
+ */
+static void udp_nat_send(struct udp_raw_state *es, struct pbuf *p) {
+    if (!es->ready) {
+        /* the associate is still in progress, keep a bounded backlog */
+        if (es->queue_len == UDP_NAT_QUEUE_MAX) {
+            stats.udp_nat_queue_drops++;
+            pbuf_free(p);
+            return;
+        }
+        es->queue[es->queue_len++] = p;
+        return;
+    }
+    if (tx_count == UDP_RELAY_BATCH) {
+        udp_raw_flush();
+    }
+
+    struct iovec *iov = tx_iov[tx_count];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = es->hdr;
+    iov[iovcnt++].iov_len = es->hdr_len;
+    struct pbuf *q;
+    for (q = p; q != NULL && iovcnt < UDP_RELAY_IOV; q = q->next) {
+        iov[iovcnt].iov_base = q->payload;
+        iov[iovcnt++].iov_len = q->len;
+    }
+    if (q != NULL) {
+        printf("udp datagram in too many pbufs, drop\n");
+        pbuf_free(p);
+        return;
+    }
+
+    struct msghdr *msg = &tx_msgs[tx_count].msg_hdr;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_name = &(es->addr);
+    msg->msg_namelen = sizeof(es->addr);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = iovcnt;
+    tx_pbufs[tx_count] = p;
+    tx_fds[tx_count] = es->assoc != NULL ? es->assoc->io.fd : es->io.fd;
+    tx_count++;
+}
+
 /**
  * receive callback for a UDP PCB
  * pcb->recv(pcb->recv_arg, pcb, p, ip_current_src_addr(), src_port)
@@ -288,6 +1039,12 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
             pbuf_free(p);
             return;
         }
+        if (fake_ip_enabled() &&
+            fake_dns_reply(upcb, p, reinterpret_cast<const u_char *>(buffer->buffer), addr, port, cppdomain)) {
+            free(buffer->buffer);
+            free(buffer);
+            return;
+        }
         std::cout << cppdomain << " via tcp dns server " << conf->remote_dns_server << std::endl;
 
         query = static_cast<char *>(malloc(p->len + 3));
@@ -295,7 +1052,18 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
         query[1] = (char) p->len;
         memcpy(query + 2, buffer->buffer, p->len);
 
-        int socks_fd = socks5_connect(conf->socks_server, conf->socks_port);
+        int greeting = 0;
+        int socks_fd = socks5_pool_get();
+        if (socks_fd >= 0) {
+            setblocking(socks_fd);
+        } else {
+            socks_fd = socks5_connect(conf->socks_server, conf->socks_port);
+            greeting = socks5_get_pipeline();
+            if (socks_fd > 0 && !greeting && socks5_method(socks_fd) < 0) {
+                close(socks_fd);
+                socks_fd = -1;
+            }
+        }
         if (socks_fd < 1) {
             printf("socks5 connect failed\n");
             return;
@@ -304,15 +1072,16 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
         char dns_port[16];
         sprintf(dns_port, "%d", upcb->remote_fake_port);
 
-        int ret = socks5_auth(socks_fd, conf->remote_dns_server, dns_port, 0x01, 1);
+        // forward dns query in the same write as the request
+        int ret = socks5_request_pipelined(socks_fd, greeting, conf->remote_dns_server, dns_port, 0x01, 1, query,
+                                           p->len + 2);
+        free(query);
         if (ret < 0) {
             printf("socks5 auth failed\n");
+            close(socks_fd);
             return;
         }
 
-        // forward dns query
-        send(socks_fd, query, p->len + 2, 0);
-
         es = (struct udp_raw_state *) malloc(sizeof(struct udp_raw_state));
         memset(es, 0, sizeof(struct udp_raw_state));
         es->pcb = upcb;
@@ -343,11 +1112,12 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
         return;
     }
 
-    char buf[TCP_WND];
-    pbuf_copy_partial(p, buf, p->tot_len, 0);
+    /* the largest dns message, a whole tcp window no longer fits the stack */
+    static char buf[0xffff];
 
     char *domain = NULL;
     if (strcmp("udp", conf->dns_mode) == 0 && upcb->remote_fake_port == atoi(conf->local_dns_port)) {
+        pbuf_copy_partial(p, buf, p->tot_len, 0);
         bool matched = false;
         bool blocked = false;
         std::string dns_server("114.114.114.114"); // default dns server
@@ -420,6 +1190,10 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
             pbuf_free(p);
             return;
         }
+        if (fake_ip_enabled() &&
+            fake_dns_reply(upcb, p, reinterpret_cast<const u_char *>(buf), addr, port, cppdomain)) {
+            return;
+        }
     }
     if (strcmp("udp", conf->dns_mode) == 0 && upcb->remote_fake_port == atoi(conf->local_dns_port)) {
         // printf("UDP DNS query\n");
@@ -430,163 +1204,237 @@ udp_raw_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
         }
     }
 
+    /* datagrams to the fake range go to the proxy by domain name */
+    const char *fake_domain = NULL;
+    if (fake_ip_contains(ip_addr_get_ip4_u32(&upcb->remote_fake_ip))) {
+        fake_domain = fake_ip_domain(ip_addr_get_ip4_u32(&upcb->remote_fake_ip));
+        if (fake_domain == NULL) {
+            printf("UDP to a fake ip with no domain, drop\n");
+            stats.fake_ip_unknown++;
+            pbuf_free(p);
+            return;
+        }
+    }
 
-    es = (struct udp_raw_state *) malloc(sizeof(struct udp_raw_state));
-    memset(es, 0, sizeof(struct udp_raw_state));
-    es->pcb = upcb;
-    es->state = 0;
-    es->retries = 0;
-    es->udp_port = port;
-    inet_ntop(AF_INET, addr, es->addr_ip, INET_ADDRSTRLEN);
+    struct udp_nat_key key;
+    key.src = ip_addr_get_ip4_u32(addr);
+    key.dst = ip_addr_get_ip4_u32(&upcb->remote_fake_ip);
+    key.sport = port;
+    key.dport = upcb->remote_fake_port;
 
-    int socks_fd = socks5_connect(conf->socks_server, conf->socks_port);
-    if (socks_fd < 1) {
-        printf("socks5 connect failed\n");
-        return;
+    std::unordered_map<udp_nat_key, struct udp_raw_state *, udp_nat_key_hash>::iterator it = nat_table.find(key);
+    if (it != nat_table.end()) {
+        es = it->second;
+        stats.udp_nat_reused++;
+    } else {
+        es = udp_nat_open(upcb, addr, port, key, fake_domain, domain);
+        if (es == NULL) {
+            pbuf_free(p);
+            return;
+        }
     }
+    udp_nat_touch(es);
+    udp_nat_send(es, p);
+}
 
-    char buff[BUFFER_SIZE];
-    /**
-     * socks 5 method request start
-     */
-    ((socks5_method_req_t *) buff)->ver = SOCKS5_VERSION;
-    ((socks5_method_req_t *) buff)->nmethods = 0x01;
-    ((socks5_method_req_t *) buff)->methods[0] = 0x00;
-    send(socks_fd, buff, 3, 0);
-    // VERSION and METHODS
-    if (-1 == recv(socks_fd, buff, 2, 0)) {
-        printf("recv VERSION and METHODS error\n");
-        return;
-    };
-    if (SOCKS5_VERSION != ((socks5_method_res_t *) buff)->ver || 0x00 != ((socks5_method_res_t *) buff)->method) {
-        printf("socks5_method_res_t error\n");
-        return;
+void
+udp_raw_set_nat(int max, int idle) {
+    if (max > 0) {
+        nat_max = (size_t) max;
     }
-    /**
-     * socks 5 method request end
-     */
-
-    /**
-     * socks 5 request start
-     */
-    size_t idx = 0;
-    buff[idx++] = 5; /* version */
-    buff[idx++] = 3; /* udp */
-    buff[idx++] = 0;
-    buff[idx++] = 1; /* ATYP: IPv4 = 1 */
-
-    struct sockaddr_in *saddr_in = (struct sockaddr_in *) malloc(sizeof(struct sockaddr_in));;
-    saddr_in->sin_family = AF_INET;
-
-    char remote_fake_ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(upcb->remote_fake_ip), remote_fake_ip_str, INET_ADDRSTRLEN);
-
-    if (strcmp("udp", conf->dns_mode) == 0 && upcb->remote_fake_port == atoi(conf->local_dns_port)) {
-        inet_aton(conf->remote_dns_server, &(saddr_in->sin_addr));
-        printf("UDP dns query %s redirect to remote dns server %s\n", domain, conf->remote_dns_server);
-    } else {
-        inet_aton(remote_fake_ip_str, &(saddr_in->sin_addr));
-        printf("UDP via socks 5 udp tunnel to %s\n", remote_fake_ip_str);
+    if (idle > 0) {
+        nat_timeout = idle;
     }
-    for (int i = 0; i < 4; i++) {
-        buff[idx++] = ((unsigned char *) &saddr_in->sin_addr.s_addr)[i];
+}
+
+void
+udp_raw_set_associations(int count) {
+    if (count > 0) {
+        assocs.assign((size_t) count, NULL);
     }
+}
 
-    int pport = 0;
-    if (strcmp("udp", conf->dns_mode) == 0 && upcb->remote_fake_port == atoi(conf->local_dns_port)) {
-        pport = atoi(conf->remote_dns_port);
-    } else {
-        pport = upcb->remote_fake_port;
-    }
-    buff[idx++] = (unsigned char) ((pport >> 8) & 0xff); /* PORT MSB */
-    buff[idx++] = (unsigned char) (pport & 0xff);        /* PORT LSB */
-
-    send(socks_fd, (char *) buff, idx, 0);
-    free(saddr_in);
-    /**
-     * socks 5 request end
-     */
-
-    /**
-     * socks 5 response
-     */
-    if (-1 == recv(socks_fd, buff, 10, 0)) {
-        printf("recv socks 5 response error\n");
-        return;
-    };
-    if (SOCKS5_VERSION != ((socks5_response_t *) buff)->ver) {
-        printf("socks 5 response version error\n");
-        return;
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+static size_t udp_tx_len(int i) {
+    size_t len = 0;
+    for (size_t v = 0; v < tx_msgs[i].msg_hdr.msg_iovlen; v++) {
+        len += tx_msgs[i].msg_hdr.msg_iov[v].iov_len;
     }
+    return len;
+}
 
-    char *udp_ip_str = inet_ntoa(*(in_addr *) (&buff[4]));
-    int udp_port = ntohs(*(short *) (&buff[8]));
+/**
+ * build out_msgs from queue entries [i, j), all to one socket. with offload on, a run of datagrams
+ * to the same relay of the same size, the last may be shorter, becomes one UDP_SEGMENT send.
+ * only sizes up to udp_gso_max_seg are merged, the kernel refuses segments above the path mtu
+ */
+static int udp_tx_merge(int i, int j) {
+    int m = 0;
+    int v = 0;
+
+    while (i < j) {
+        struct msghdr *first = &tx_msgs[i].msg_hdr;
+        struct msghdr *msg = &out_msgs[m].msg_hdr;
+        size_t seg = udp_tx_len(i);
+        size_t total = 0;
+        int k = i;
+        int max_segs = udp_tx_gso && seg <= udp_gso_max_seg ? UDP_GSO_MAX_SEGMENTS : 1;
+
+        memset(&out_msgs[m], 0, sizeof(struct mmsghdr));
+        msg->msg_name = first->msg_name;
+        msg->msg_namelen = first->msg_namelen;
+        msg->msg_iov = &out_iov[v];
+        while (k < j && k - i < max_segs) {
+            struct msghdr *next = &tx_msgs[k].msg_hdr;
+            size_t len = udp_tx_len(k);
+            if (k > i && (len > seg || total + len > UDP_GSO_MAX_BYTES ||
+                          memcmp(next->msg_name, first->msg_name, sizeof(struct sockaddr_in)) != 0)) {
+                break;
+            }
+            memcpy(&out_iov[v], next->msg_iov, next->msg_iovlen * sizeof(struct iovec));
+            v += next->msg_iovlen;
+            msg->msg_iovlen += next->msg_iovlen;
+            total += len;
+            k++;
+            if (len < seg) {
+                break;
+            }
+        }
+
+        out_segs[m] = k - i;
+        out_first[m] = i;
+        if (k - i > 1) {
+            uint16_t gso_size = (uint16_t) seg;
+            msg->msg_control = out_ctrl[m];
+            msg->msg_controllen = sizeof(out_ctrl[m]);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+        m++;
+        i = k;
+    }
+    return m;
+}
+#endif
 
-    struct sockaddr_in socks_proxy_addr;
-    socks_proxy_addr.sin_family = AF_INET;
-    socks_proxy_addr.sin_addr.s_addr = inet_addr(udp_ip_str);
-    socks_proxy_addr.sin_port = htons(udp_port);
+/**
+ * send the datagrams queued this loop iteration, one sendmmsg per run of the same socket
+ */
+void
+udp_raw_flush(void) {
+    int i = 0;
 
-    idx = 0;
-    buff[idx++] = 0; /* RSV */
-    buff[idx++] = 0; /* RSV */
-    buff[idx++] = 0; /* FRAG */
-    buff[idx++] = 1; /* ATYP: IPv4 = 1 */
+    while (i < tx_count) {
+        int j = i + 1;
+        while (j < tx_count && tx_fds[j] == tx_fds[i]) {
+            j++;
+        }
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+        int count = udp_tx_merge(i, j);
+        int k = 0;
+        while (k < count) {
+            int sent = sendmmsg(tx_fds[i], &out_msgs[k], (unsigned int) (count - k), 0);
+            stats.udp_tx_syscalls++;
+            if (sent <= 0 && out_segs[k] > 1 && (errno == EIO || errno == EINVAL || errno == EMSGSIZE)) {
+                if (errno == EIO) {
+                    /* the route cannot segment, no device checksum offload */
+                    printf("udp segmentation offload not usable, off\n");
+                    udp_tx_gso = 0;
+                } else {
+                    /* the segments do not fit the path mtu, stop merging this size */
+                    size_t seg = udp_tx_len(out_first[k]);
+                    printf("udp segment of %zu bytes over the path mtu, merge below it\n", seg);
+                    udp_gso_max_seg = seg - 1;
+                }
+                /* send the rest of the run again, the failed datagrams unmerged */
+                count = udp_tx_merge(out_first[k], j);
+                k = 0;
+                continue;
+            }
+            if (sent <= 0) {
+                /* the first one failed, the rest of the run goes in the next call */
+                printf("udp relay sendmmsg failed, errno %d\n", errno);
+                sent = 1;
+            } else {
+                for (int m = k; m < k + sent; m++) {
+                    stats.udp_tx_datagrams += out_segs[m];
+                    if (out_segs[m] > 1) {
+                        stats.udp_tx_gso_sends++;
+                    }
+                }
+            }
+            k += sent;
+        }
+        i = j;
+#else
+        int sent;
+#if defined(LWIP_UNIX_LINUX)
+        sent = sendmmsg(tx_fds[i], &tx_msgs[i], (unsigned int) (j - i), 0);
+#else
+        sent = sendmsg(tx_fds[i], &tx_msgs[i].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+        stats.udp_tx_syscalls++;
+        if (sent <= 0) {
+            /* the first one failed, the rest of the run goes in the next call */
+            printf("udp relay sendmmsg failed, errno %d\n", errno);
+            sent = 1;
+        } else {
+            stats.udp_tx_datagrams += sent;
+        }
+        i += sent;
+#endif
+    }
 
-    struct sockaddr_in *udp_saddr_in = (struct sockaddr_in *) malloc(sizeof(struct sockaddr_in));;
-    udp_saddr_in->sin_family = AF_INET;
-    if (strcmp("udp", conf->dns_mode) == 0 && upcb->remote_fake_port == atoi(conf->local_dns_port)) {
-        inet_aton(conf->remote_dns_server, &(udp_saddr_in->sin_addr));
-    } else {
-        inet_aton(remote_fake_ip_str, &(udp_saddr_in->sin_addr));
+    for (i = 0; i < tx_count; i++) {
+        pbuf_free(tx_pbufs[i]);
     }
-    for (int i = 0; i < 4; i++) {
-        buff[idx++] = ((unsigned char *) &udp_saddr_in->sin_addr.s_addr)[i];
+    tx_count = 0;
+}
+
+/**
+ * UDP_SEGMENT on relay sends and UDP_GRO on relay reads, off if the kernel has neither.
+ * the relays sit at the socks server, its route mtu bounds the merged segment size
+ */
+void
+udp_raw_set_offload(int offload) {
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+    if (!offload) {
+        return;
     }
-    if (strcmp("udp", conf->dns_mode) == 0 && upcb->remote_fake_port == atoi(conf->local_dns_port)) {
-        pport = atoi(conf->remote_dns_port);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int opt = 1;
+    int gso_size = 1200;
+    if (fd < 0 || setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) < 0 ||
+        setsockopt(fd, IPPROTO_UDP, UDP_GRO, &opt, sizeof(opt)) < 0) {
+        printf("udp_offload is not supported by this kernel\n");
     } else {
-        pport = upcb->remote_fake_port;
+        struct sockaddr_in relay;
+        int mtu = 0;
+        socklen_t len = sizeof(mtu);
+
+        memset(&relay, 0, sizeof(relay));
+        relay.sin_family = AF_INET;
+        relay.sin_addr.s_addr = inet_addr(conf->socks_server);
+        relay.sin_port = htons((uint16_t) atoi(conf->socks_port));
+        if (connect(fd, (struct sockaddr *) &relay, sizeof(relay)) == 0 &&
+            getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 && mtu > 28) {
+            udp_gso_max_seg = (size_t) mtu - 20 - 8;
+        }
+        printf("udp_offload: segments up to %zu bytes\n", udp_gso_max_seg);
+        udp_tx_gso = 1;
+        udp_rx_gro = 1;
     }
-    buff[idx++] = (unsigned char) ((pport >> 8) & 0xff); /* PORT MSB */
-    buff[idx++] = (unsigned char) (pport & 0xff);        /* PORT LSB */
-
-    memcpy(buff + idx, buf, p->tot_len);
-
-    int udp_relay_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    setnonblocking(udp_relay_fd);
-
-    sockaddr_in localAddr;
-    memset(&localAddr, 0, sizeof(localAddr));
-    localAddr.sin_family = AF_INET;
-    localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    localAddr.sin_port = htons(0);
-    if (bind(udp_relay_fd, (struct sockaddr *) &localAddr, sizeof(localAddr)) < 0) {
-        printf("bind udp relay failed\n");
-        return;
+    if (fd >= 0) {
+        close(fd);
     }
-    int addr_len = sizeof(sockaddr_in);
-    ssize_t nread = sendto(udp_relay_fd, buff, p->tot_len + idx, 0, (struct sockaddr *) (&socks_proxy_addr),
-                           static_cast<socklen_t>(addr_len));
-    if (nread < 0) {
-        printf("udp query sendto failed\n");
-        return;
+#else
+    if (offload) {
+        printf("udp_offload is not supported on this platform\n");
     }
-
-    es->addr = socks_proxy_addr;
-    es->addr_len = addr_len;
-    es->socks_tcp_fd = socks_fd;
-
-    es->timeout_ctx = (udp_timer_ctx *) malloc(sizeof(udp_timer_ctx));
-    memset(es->timeout_ctx, 0, sizeof(udp_timer_ctx));
-    es->timeout_ctx->raw_state = es;
-
-    ev_timer_init(&(es->timeout_ctx->watcher), timeout_cb, timeout, 0.);
-    ev_timer_start(EV_DEFAULT, &(es->timeout_ctx->watcher));
-
-    ev_io_init(&(es->io), udp_socks_relay_cb, udp_relay_fd, EV_READ);
-    ev_io_start(EV_DEFAULT, &(es->io));
-    pbuf_free(p);
+#endif
 }
 
 void
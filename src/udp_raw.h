@@ -4,6 +4,33 @@
 #ifndef LWIP_UDP_RAW_H
 #define LWIP_UDP_RAW_H
 
+/* relay sessions kept at once, the least recently used one is closed for a new flow */
+#define UDP_NAT_MAX 1024
+/* seconds a relay session lives without traffic */
+#define UDP_NAT_TIMEOUT 60.
+/* seconds the UDP ASSOCIATE may take */
+#define UDP_NAT_CONNECT_TIMEOUT 10.
+/* datagrams a flow keeps while its associate is in progress, later ones are dropped */
+#define UDP_NAT_QUEUE_MAX 16
+
+/* datagrams per sendmmsg/recvmmsg on the relay sockets */
+#define UDP_RELAY_BATCH 16
+/* socks header plus the pbufs of one datagram */
+#define UDP_RELAY_IOV 8
+/* kernel limits for one UDP_SEGMENT send */
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES 65507
+/* a merged send's segments must each fit the path mtu to the relay, ethernet unless probed */
+#define UDP_GSO_MAX_SEG (1500 - 20 - 8)
+
 void udp_raw_init(void);
 
+void udp_raw_flush(void);
+
+void udp_raw_set_offload(int offload);
+
+void udp_raw_set_nat(int max, int timeout);
+
+void udp_raw_set_associations(int count);
+
 #endif /* LWIP_UDP_RAW_H */
@@ -1,6 +1,8 @@
 #define SLASH "/"
 #define BUFFER_SIZE 1514
 #define UDP_BUFFER_SIZE 1460
+// largest udp datagram relayed back from socks, tun mtu can go up to 64K
+#define UDP_RELAY_BUFFER_SIZE 0x10000
 #define NUM_OPTS ((sizeof(longopts) / sizeof(struct option)) - 1)
 #define container_of(ptr, type, member) ({      \
   const typeof( ((type *)0)->member ) *__mptr = (ptr);  \
@@ -0,0 +1,123 @@
+/**
+ * non-blocking socks5 handshake against a socketpair, sendmsg is capped to force short writes
+ */
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#include "socks5.h"
+#include "socket_util.h"
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+static size_t sendmsg_cap = 0; // bytes the next sendmsg may take, 0 for no limit
+
+/* the handshake calls this one instead of libc's */
+extern "C" ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    struct msghdr capped = *msg;
+    struct iovec iov[1 + SOCKS5_PAYLOAD_IOV_MAX];
+
+    if (sendmsg_cap > 0) {
+        size_t left = sendmsg_cap;
+        size_t n = 0;
+        for (size_t i = 0; i < msg->msg_iovlen && left > 0; i++) {
+            iov[n] = msg->msg_iov[i];
+            if (iov[n].iov_len > left) {
+                iov[n].iov_len = left;
+            }
+            left -= iov[n].iov_len;
+            n++;
+        }
+        capped.msg_iov = iov;
+        capped.msg_iovlen = n;
+        sendmsg_cap = 0;
+    }
+    return syscall(SYS_sendmsg, fd, &capped, flags);
+}
+
+static void pair(int sv[2]) {
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    setnonblocking(sv[0]);
+}
+
+static size_t read_all(int fd, char *buf, size_t len) {
+    ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+    return n < 0 ? 0 : (size_t) n;
+}
+
+static const char connect_reply[] = {5, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+
+/**
+ * a request cut short goes out in full on the next write, with the payload behind it
+ */
+static void test_request_short_write(void) {
+    int sv[2];
+    socks5_handshake_t hs;
+    char want[SOCKS5_REPLY_MAX_SIZE + 5];
+    char got[sizeof(want)];
+    size_t sent = 0;
+    struct iovec payload;
+
+    pair(sv);
+    socks5_handshake_init_negotiated(&hs, "1.2.3.4", "80", SOCKS5_CMD_CONNECT, 1);
+    size_t req_len = socks5_build_request(want, "1.2.3.4", "80", SOCKS5_CMD_CONNECT, 1);
+    memcpy(want + req_len, "hello", 5);
+    payload.iov_base = (void *) "hello";
+    payload.iov_len = 5;
+
+    sendmsg_cap = 3;
+    CHECK(socks5_handshake_step_payload(sv[0], &hs, &payload, 1, &sent) == 0);
+    CHECK(hs.req_sent == hs.req_len);
+    CHECK(sent == 5);
+    CHECK(read_all(sv[1], got, sizeof(got)) == req_len + 5);
+    CHECK(memcmp(got, want, req_len + 5) == 0);
+
+    CHECK(send(sv[1], connect_reply, sizeof(connect_reply), 0) == sizeof(connect_reply));
+    CHECK(socks5_handshake_step(sv[0], &hs) == 1);
+    CHECK(hs.stage == SOCKS5_STAGE_ESTABLISHED);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/**
+ * same with the greeting pipelined in front of the request
+ */
+static void test_pipelined_short_write(void) {
+    int sv[2];
+    socks5_handshake_t hs;
+    char want[SOCKS5_GREETING_SIZE + SOCKS5_REPLY_MAX_SIZE];
+    char got[sizeof(want)];
+    const char greeting[SOCKS5_GREETING_SIZE] = {5, 1, 0};
+    const char method_reply[] = {5, 0};
+
+    pair(sv);
+    socks5_set_pipeline(1);
+    socks5_handshake_init(&hs, "1.2.3.4", "80", SOCKS5_CMD_CONNECT, 1);
+    socks5_set_pipeline(0);
+    memcpy(want, greeting, sizeof(greeting));
+    size_t len = sizeof(greeting) + socks5_build_request(want + sizeof(greeting), "1.2.3.4", "80",
+                                                         SOCKS5_CMD_CONNECT, 1);
+
+    sendmsg_cap = 2;
+    CHECK(socks5_handshake_step(sv[0], &hs) == 0);
+    CHECK(read_all(sv[1], got, sizeof(got)) == len);
+    CHECK(memcmp(got, want, len) == 0);
+
+    CHECK(send(sv[1], method_reply, sizeof(method_reply), 0) == sizeof(method_reply));
+    CHECK(send(sv[1], connect_reply, sizeof(connect_reply), 0) == sizeof(connect_reply));
+    CHECK(socks5_handshake_step(sv[0], &hs) == 1);
+    CHECK(hs.stage == SOCKS5_STAGE_ESTABLISHED);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(void) {
+    test_request_short_write();
+    test_pipelined_short_write();
+    printf("socks5_test ok\n");
+    return 0;
+}